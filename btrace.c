@@ -0,0 +1,392 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "btrace.h"
+
+#define MODULE "[btrace]"
+
+// ==========================================================================
+// Encoding helpers
+
+static inline void put_u32(unsigned char *p, unsigned long v)
+{
+    p[0] = v; p[1] = v>>8; p[2] = v>>16; p[3] = v>>24;
+}
+
+static inline void put_u64(unsigned char *p, unsigned long v)
+{
+    put_u32(p, v & 0xFFFFFFFFUL);
+    put_u32(p+4, v>>32);
+}
+
+static inline unsigned long get_u32(const unsigned char *p)
+{
+    return p[0] | (unsigned long)p[1]<<8 | (unsigned long)p[2]<<16 | (unsigned long)p[3]<<24;
+}
+
+static inline unsigned long get_u64(const unsigned char *p)
+{
+    return get_u32(p) | get_u32(p+4)<<32;
+}
+
+static inline unsigned char *put_varint(unsigned char *p, unsigned long v)
+{
+    while(v>=0x80) {
+        *p++ = v | 0x80;
+        v >>= 7;
+    }
+    *p++ = v;
+    return p;
+}
+
+// return end of varint, or NULL if it runs past end
+static inline const unsigned char *get_varint(const unsigned char *p,
+                    const unsigned char *end, unsigned long *v)
+{
+    unsigned long n = 0;
+    int shift = 0;
+
+    while(p<end && shift<64) {
+        unsigned char c = *p++;
+
+        n |= (unsigned long)(c & 0x7F) << shift;
+        if(!(c & 0x80)) {
+            *v = n;
+            return p;
+        }
+        shift += 7;
+    }
+    return NULL;
+}
+
+// ==========================================================================
+// Writer
+
+int btrace_writer_open(struct btrace_writer *w, FILE *f)
+{
+    unsigned char header[BTRACE_HEADER_BYTES];
+
+    memset(w, 0, sizeof(*w));
+    w->f = f;
+    w->block = malloc(BTRACE_BLOCK_POINTS*2*BTRACE_VARINT_MAX);
+    if(NULL==w->block) return -1;
+
+    memset(header, 0, sizeof(header));
+    memcpy(header, BTRACE_MAGIC, 4);
+    header[4] = BTRACE_VERSION; header[5] = BTRACE_VERSION>>8;
+    header[6] = BTRACE_HEADER_BYTES; header[7] = BTRACE_HEADER_BYTES>>8;
+    put_u32(header+8, BTRACE_BLOCK_POINTS);
+    if(1!=fwrite(header, sizeof(header), 1, f)) return -1;
+    w->offset = BTRACE_HEADER_BYTES;
+    return 0;
+}
+
+static int flush_block(struct btrace_writer *w)
+{
+    unsigned char header[BTRACE_BLOCK_HEADER_BYTES];
+    struct btrace_index_entry *e;
+
+    if(0==w->block_points) return 0;
+
+    if(w->index_count==w->index_cap) {
+        unsigned long cap = w->index_cap ? w->index_cap*2 : 256;
+        struct btrace_index_entry *index = realloc(w->index, cap*sizeof(*index));
+
+        if(NULL==index) return -1;
+        w->index = index;
+        w->index_cap = cap;
+    }
+    e = &w->index[w->index_count++];
+    e->time_ns = w->block_time_ns;
+    e->offset = w->offset;
+    e->first_point = w->points - w->block_points;
+    e->bytes_before = w->bytes_before;
+
+    put_u32(header, w->block_points);
+    put_u32(header+4, w->block_len);
+    put_u64(header+8, w->block_time_ns);
+    put_u64(header+16, w->bytes_before);
+    if(1!=fwrite(header, sizeof(header), 1, w->f)) return -1;
+    if(1!=fwrite(w->block, w->block_len, 1, w->f)) return -1;
+
+    w->offset += sizeof(header) + w->block_len;
+    w->block_len = 0;
+    w->block_points = 0;
+    w->bytes_before = w->bytes;
+    return 0;
+}
+
+int btrace_writer_add(struct btrace_writer *w, long time_ns, unsigned long bytes)
+{
+    unsigned char *p;
+
+    if(w->block_points==BTRACE_BLOCK_POINTS && flush_block(w)<0) return -1;
+
+    if(0==w->block_points) {
+        // keep times non-decreasing across blocks
+        if(w->points && time_ns<w->prev_time_ns) time_ns = w->prev_time_ns;
+        w->block_time_ns = time_ns;
+        w->prev_time_ns = time_ns;
+    }
+    if(time_ns<w->prev_time_ns) time_ns = w->prev_time_ns;
+
+    p = w->block + w->block_len;
+    p = put_varint(p, time_ns - w->prev_time_ns);
+    p = put_varint(p, bytes);
+    w->block_len = p - w->block;
+    w->block_points++;
+    w->prev_time_ns = time_ns;
+    w->points++;
+    w->bytes += bytes;
+    return 0;
+}
+
+int btrace_writer_close(struct btrace_writer *w)
+{
+    unsigned char buf[BTRACE_INDEX_ENTRY_BYTES];
+    unsigned long i;
+    int ret = 0;
+
+    if(flush_block(w)<0) ret = -1;
+
+    for(i=0; 0==ret && i<w->index_count; ++i) {
+        put_u64(buf, w->index[i].time_ns);
+        put_u64(buf+8, w->index[i].offset);
+        put_u64(buf+16, w->index[i].first_point);
+        put_u64(buf+24, w->index[i].bytes_before);
+        if(1!=fwrite(buf, sizeof(buf), 1, w->f)) ret = -1;
+    }
+
+    if(0==ret) {
+        put_u64(buf, w->offset);
+        put_u64(buf+8, w->index_count);
+        put_u64(buf+16, w->points);
+        memcpy(buf+24, BTRACE_INDEX_MAGIC, 4);
+        put_u32(buf+28, BTRACE_VERSION);
+        if(1!=fwrite(buf, BTRACE_TRAILER_BYTES, 1, w->f)) ret = -1;
+    }
+    if(0!=fflush(w->f)) ret = -1;
+
+    free(w->block);
+    free(w->index);
+    w->block = NULL;
+    w->index = NULL;
+    return ret;
+}
+
+// ==========================================================================
+// Reader
+
+int btrace_is_btrace(const void *buf, unsigned long len)
+{
+    return len>=BTRACE_HEADER_BYTES && 0==memcmp(buf, BTRACE_MAGIC, 4);
+}
+
+// decode a block only to check it, when there is no index to trust
+static int check_block(const unsigned char *p, const unsigned char *end,
+                    unsigned long points, unsigned long *bytes)
+{
+    unsigned long i, v;
+
+    for(i=0; i<points; ++i) {
+        if(NULL==(p=get_varint(p, end, &v))) return -1;
+        if(NULL==(p=get_varint(p, end, &v))) return -1;
+        *bytes += v;
+    }
+    return p==end ? 0 : -1;
+}
+
+static int load_index(struct btrace_reader *r)
+{
+    const unsigned char *t = r->map + r->len - BTRACE_TRAILER_BYTES;
+    unsigned long offset, i, cap = 0, bytes = 0;
+
+    if(r->len>=BTRACE_HEADER_BYTES+BTRACE_TRAILER_BYTES
+            && 0==memcmp(t+24, BTRACE_INDEX_MAGIC, 4)) {
+        unsigned long index_offset = get_u64(t);
+        unsigned long count = get_u64(t+8);
+
+        if(index_offset<=r->len && count <= (r->len-index_offset)/BTRACE_INDEX_ENTRY_BYTES) {
+            r->index = malloc((count+1)*sizeof(*r->index));
+            if(NULL==r->index) return -1;
+            for(i=0; i<count; ++i) {
+                const unsigned char *e = r->map + index_offset + i*BTRACE_INDEX_ENTRY_BYTES;
+
+                r->index[i].time_ns = get_u64(e);
+                r->index[i].offset = get_u64(e+8);
+                r->index[i].first_point = get_u64(e+16);
+                r->index[i].bytes_before = get_u64(e+24);
+                if(r->index[i].offset+BTRACE_BLOCK_HEADER_BYTES > index_offset) {
+                    errno = EINVAL;
+                    return -1;
+                }
+            }
+            r->block_count = count;
+            r->points = get_u64(t+16);
+            return 0;
+        }
+    }
+
+    // no index, walk the blocks and keep those that decode
+    offset = BTRACE_HEADER_BYTES;
+    while(offset+BTRACE_BLOCK_HEADER_BYTES <= r->len) {
+        const unsigned char *h = r->map + offset;
+        unsigned long points = get_u32(h), payload = get_u32(h+4);
+        unsigned long block_bytes = 0;
+
+        if(0==points || payload > r->len-offset-BTRACE_BLOCK_HEADER_BYTES) break;
+        if(get_u64(h+16)!=bytes) break;
+        if(check_block(h+BTRACE_BLOCK_HEADER_BYTES, h+BTRACE_BLOCK_HEADER_BYTES+payload,
+                    points, &block_bytes)<0) break;
+
+        if(r->block_count==cap) {
+            struct btrace_index_entry *index;
+
+            cap = cap ? cap*2 : 256;
+            index = realloc(r->index, cap*sizeof(*index));
+            if(NULL==index) return -1;
+            r->index = index;
+        }
+        r->index[r->block_count].time_ns = get_u64(h+8);
+        r->index[r->block_count].offset = offset;
+        r->index[r->block_count].first_point = r->points;
+        r->index[r->block_count].bytes_before = bytes;
+        r->block_count++;
+        r->points += points;
+        bytes += block_bytes;
+        offset += BTRACE_BLOCK_HEADER_BYTES + payload;
+    }
+    fprintf(stderr, "%s no index, recovered %lu blocks of %lu points\n",
+            MODULE, r->block_count, r->points);
+    return 0;
+}
+
+int btrace_reader_open(struct btrace_reader *r, const char *path)
+{
+    struct stat st;
+    void *map;
+    int fd, err;
+
+    memset(r, 0, sizeof(*r));
+
+    fd = open(path, O_RDONLY);
+    if(fd<0) return -1;
+    if(fstat(fd, &st)<0) {
+        err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    if(st.st_size<BTRACE_HEADER_BYTES) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    err = errno;
+    close(fd);
+    if(MAP_FAILED==map) {
+        errno = err;
+        return -1;
+    }
+    r->map = map;
+    r->len = st.st_size;
+
+    if(!btrace_is_btrace(r->map, r->len) || (r->map[4] | r->map[5]<<8) > BTRACE_VERSION) {
+        btrace_reader_close(r);
+        errno = EINVAL;
+        return -1;
+    }
+    if(load_index(r)<0) {
+        err = errno;
+        btrace_reader_close(r);
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+static void open_block(struct btrace_reader *r, unsigned long block)
+{
+    const unsigned char *h = r->map + r->index[block].offset;
+
+    r->left = get_u32(h);
+    r->pos = h + BTRACE_BLOCK_HEADER_BYTES;
+    r->end = r->pos + get_u32(h+4);
+    if(r->end > r->map + r->len) r->end = r->map + r->len;
+    r->time_ns = get_u64(h+8);
+    r->block = block+1;
+}
+
+int btrace_reader_next(struct btrace_reader *r, long *time_ns, unsigned long *bytes)
+{
+    unsigned long delta;
+
+    while(0==r->left) {
+        if(r->block>=r->block_count) return 0;
+        open_block(r, r->block);
+    }
+
+    if(NULL==(r->pos=get_varint(r->pos, r->end, &delta))
+            || NULL==(r->pos=get_varint(r->pos, r->end, bytes))) {
+        r->left = 0;
+        r->block = r->block_count;
+        return -1;
+    }
+    r->left--;
+    r->time_ns += delta;
+    *time_ns = r->time_ns;
+    return 1;
+}
+
+void btrace_reader_seek(struct btrace_reader *r, long time_ns)
+{
+    unsigned long lo = 0, hi = r->block_count;
+    const unsigned char *pos;
+    unsigned long left, b, bytes;
+    long t, point_ns;
+    int got;
+
+    // last block starting before time_ns, points at time_ns may end the
+    // block before the one starting at time_ns
+    while(lo<hi) {
+        unsigned long mid = lo + (hi-lo)/2;
+
+        if(r->index[mid].time_ns<time_ns) lo = mid+1;
+        else hi = mid;
+    }
+    r->left = 0;
+    r->block = lo ? lo-1 : 0;
+    if(r->block>=r->block_count) return;
+    open_block(r, r->block);
+
+    // skip earlier points, stopping before the first one to keep
+    do {
+        pos = r->pos;
+        left = r->left;
+        t = r->time_ns;
+        b = r->block;
+    } while(1==(got=btrace_reader_next(r, &point_ns, &bytes)) && point_ns<time_ns);
+
+    if(1==got) {
+        // step back over the point just decoded
+        r->pos = pos;
+        r->left = left;
+        r->time_ns = t;
+        r->block = b;
+    }
+}
+
+void btrace_reader_close(struct btrace_reader *r)
+{
+    if(r->map) munmap((void *)r->map, r->len);
+    free(r->index);
+    r->map = NULL;
+    r->index = NULL;
+}
@@ -0,0 +1,93 @@
+#ifndef __BTRACE_H__
+#define __BTRACE_H__
+
+#include <stdio.h>
+
+// ==========================================================================
+// Binary byte traces. A file is a header, blocks of points, a block index
+// and a trailer. All integers are little-endian.
+//
+//   header   "BTRC" u16 version, u16 header bytes, u32 points per block,
+//            u32 flags, u64 reserved x2                          32 bytes
+//   block    u32 points, u32 payload bytes, i64 first time ns,
+//            u64 bytes before block                              24 bytes
+//            payload: per point varint time delta in ns from the
+//            previous point (first point from block time), varint bytes
+//   index    per block: i64 first time ns, u64 file offset,
+//            u64 first point, u64 bytes before block             32 bytes
+//   trailer  u64 index offset, u64 block count, u64 points,
+//            "BTIX", u32 version                                 32 bytes
+//
+// Varints are LEB128, 7 bits per byte, low bits first. Times are
+// non-decreasing. A file cut short, by a crash during capture, has no
+// index; readers then find the complete blocks by walking their headers.
+
+#define BTRACE_MAGIC "BTRC"
+#define BTRACE_INDEX_MAGIC "BTIX"
+#define BTRACE_VERSION 1
+#define BTRACE_HEADER_BYTES 32
+#define BTRACE_BLOCK_HEADER_BYTES 24
+#define BTRACE_INDEX_ENTRY_BYTES 32
+#define BTRACE_TRAILER_BYTES 32
+#define BTRACE_BLOCK_POINTS 4096
+#define BTRACE_VARINT_MAX 10
+
+struct btrace_index_entry {
+    long time_ns;
+    unsigned long offset;
+    unsigned long first_point;
+    unsigned long bytes_before;
+};
+
+struct btrace_writer {
+    FILE *f;
+    unsigned long offset; // file offset of next block
+
+    unsigned char *block; // payload being built
+    unsigned long block_len;
+    unsigned long block_points;
+    long block_time_ns;
+    long prev_time_ns;
+
+    unsigned long points;
+    unsigned long bytes;
+    unsigned long bytes_before; // of current block
+
+    struct btrace_index_entry *index;
+    unsigned long index_count;
+    unsigned long index_cap;
+};
+
+struct btrace_reader {
+    const unsigned char *map;
+    unsigned long len;
+
+    struct btrace_index_entry *index;
+    unsigned long block_count;
+    unsigned long points;
+
+    // cursor
+    unsigned long block; // next block to open
+    const unsigned char *pos, *end; // payload left in current block
+    unsigned long left; // points left in current block
+    long time_ns; // of last point returned
+};
+
+// write a header to f, which must be at offset 0
+int btrace_writer_open(struct btrace_writer *w, FILE *f);
+int btrace_writer_add(struct btrace_writer *w, long time_ns, unsigned long bytes);
+// write last block, index and trailer. f is left open.
+int btrace_writer_close(struct btrace_writer *w);
+
+// whether buf holds the start of a binary trace
+int btrace_is_btrace(const void *buf, unsigned long len);
+
+// mmap a binary trace. return -1 with errno set, EINVAL if not a trace.
+int btrace_reader_open(struct btrace_reader *r, const char *path);
+// move cursor before the first point at or after time_ns
+void btrace_reader_seek(struct btrace_reader *r, long time_ns);
+// return 1 and the next point, 0 at end of trace, -1 if corrupt
+int btrace_reader_next(struct btrace_reader *r, long *time_ns, unsigned long *bytes);
+void btrace_reader_close(struct btrace_reader *r);
+
+#endif //__BTRACE_H__
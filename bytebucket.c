@@ -0,0 +1,370 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+
+#include "trace.h"
+
+#define MODULE "[bytebucket]"
+
+// smoother3 writes its queue out once per pacing tick
+#define SMOOTHER3_TICK_MS 10
+
+// Sizing from captured traces:
+//
+// Token bucket envelope: the smallest burst b such that no interval of the
+// trace carries more than b + r * length bytes. With S(k) bytes arrived up
+// to point k at time t(k),
+//     b(r) = max over i<=j of S(j) - S(i-1) - r * (t(j) - t(i))
+// which for one r is one pass with a running minimum of S(i-1) - r * t(i).
+// Over all r, b is the upper hull of the points
+//     (t(j) - t(i), S(j) - S(i-1))
+// seen from above at slope r: piecewise linear, with a breakpoint at the
+// slope of every hull edge. The hull is built by halving the trace. Pairs
+// across the halves are P(j) - Q(i) for P(j) = (t(j), S(j)) of the right
+// half and Q(i) = (t(i), S(i-1)) of the left, and the hull of those is the
+// Minkowski sum of the hulls of P and -Q, a merge of their edges. With the
+// hulls of each half merged in O(n) that is O(n log n).
+//
+// Constant rate output: a smoother sending at rate R from startup delay D
+// never underflows if R * (t - D) <= S(k-1) just before every point k, so
+//     D = max over k of t(k) - S(k-1) / R
+// and the buffer it needs is the largest backlog S(k) - R * (t(k) - D).
+// Each of those is O(n), the hull and merging traces with -a are O(n log n).
+
+static double g_out_rate = 0; // bytes/sec, 0 for the trace mean
+static double g_out_factor = 1; // multiple of the trace mean, when g_out_rate is 0
+
+static double trace_mean_rate(const struct trace *t)
+{
+    double sec = t->count ? t->time_ns[t->count-1]/1e9 : 0;
+
+    return sec>0 ? trace_total_bytes(t)/sec : 0;
+}
+
+// smallest burst for rate r, bytes
+static double envelope_burst(const struct trace *t, double r)
+{
+    double sum = 0, min_start = 0, burst = 0;
+    unsigned long k;
+
+    for(k=0; k<t->count; ++k) {
+        double sec = t->time_ns[k]/1e9;
+        double start = sum - r*sec; // interval starting at point k
+
+        if(0==k || start<min_start) min_start = start;
+        sum += t->bytes[k];
+        if(sum - r*sec - min_start > burst) burst = sum - r*sec - min_start;
+    }
+    return burst;
+}
+
+// ==========================================================================
+// Envelope curve over all rates
+
+// point of a rising concave chain, x in ns and y in bytes
+struct env_point {
+    double x, y;
+};
+
+struct env_chain {
+    struct env_point *p;
+    unsigned long n;
+};
+
+static struct env_point *env_alloc(unsigned long n)
+{
+    struct env_point *p = malloc(n*sizeof(struct env_point));
+
+    if(NULL==p) {
+        fprintf(stderr, "%s cannot allocate %lu hull points\n", MODULE, n);
+        exit(1);
+    }
+    return p;
+}
+
+// > 0 when a, b, c turn left
+static double env_turn(const struct env_point *a, const struct env_point *b,
+                        const struct env_point *c)
+{
+    return (b->x - a->x)*(c->y - a->y) - (b->y - a->y)*(c->x - a->x);
+}
+
+// upper hull of points sorted by x, in place, up to its first highest
+// point: only slopes >= 0 matter for rates >= 0. return the point count.
+static unsigned long env_hull(struct env_point *p, unsigned long n)
+{
+    unsigned long h = 0, k, top = 0;
+
+    for(k=0; k<n; ++k) {
+        if(h>0 && p[h-1].x==p[k].x) {
+            if(p[k].y <= p[h-1].y) continue;
+            h--;
+        }
+        while(h>=2 && env_turn(&p[h-2], &p[h-1], &p[k]) >= 0) h--;
+        p[h++] = p[k];
+    }
+    for(k=1; k<h; ++k) {
+        if(p[k].y > p[top].y) top = k;
+    }
+    return top+1;
+}
+
+// merge two chains by x into out
+static unsigned long env_merge(const struct env_chain *a, const struct env_chain *b,
+                        struct env_point *out)
+{
+    unsigned long i = 0, j = 0, n = 0;
+
+    while(i<a->n || j<b->n) {
+        if(j>=b->n || (i<a->n && a->p[i].x <= b->p[j].x)) out[n++] = a->p[i++];
+        else out[n++] = b->p[j++];
+    }
+    return n;
+}
+
+// Minkowski sum of two rising concave chains: their edges by falling slope
+static unsigned long env_sum(const struct env_chain *a, const struct env_chain *b,
+                        struct env_point *out)
+{
+    unsigned long i = 0, j = 0, n = 0;
+
+    while(1) {
+        out[n].x = a->p[i].x + b->p[j].x;
+        out[n].y = a->p[i].y + b->p[j].y;
+        n++;
+        if(i+1>=a->n && j+1>=b->n) break;
+
+        if(j+1>=b->n) i++;
+        else if(i+1>=a->n) j++;
+        else if((a->p[i+1].y - a->p[i].y)*(b->p[j+1].x - b->p[j].x)
+                >= (b->p[j+1].y - b->p[j].y)*(a->p[i+1].x - a->p[i].x)) i++;
+        else j++;
+    }
+    return n;
+}
+
+// hulls of points lo..hi-1: P of (t(k), S(k)), Q of (-t(k), -S(k-1)), and
+// W of (t(j) - t(i), S(j) - S(i-1)) for lo <= i <= j < hi.
+// sum[k] is S(k).
+static void env_hulls(const struct trace *t, const double *sum,
+                        unsigned long lo, unsigned long hi,
+                        struct env_chain *P, struct env_chain *Q, struct env_chain *W)
+{
+    struct env_chain Pl, Ql, Wl, Pr, Qr, Wr, cross, both;
+    unsigned long mid;
+
+    if(hi-lo==1) {
+        P->p = env_alloc(1);
+        Q->p = env_alloc(1);
+        W->p = env_alloc(1);
+        P->n = Q->n = W->n = 1;
+        P->p[0].x = t->time_ns[lo];
+        P->p[0].y = sum[lo];
+        Q->p[0].x = -(double)t->time_ns[lo];
+        Q->p[0].y = -(sum[lo] - t->bytes[lo]);
+        W->p[0].x = 0;
+        W->p[0].y = t->bytes[lo];
+        return;
+    }
+
+    mid = lo + (hi-lo)/2;
+    env_hulls(t, sum, lo, mid, &Pl, &Ql, &Wl);
+    env_hulls(t, sum, mid, hi, &Pr, &Qr, &Wr);
+
+    // intervals starting in the left half and ending in the right
+    cross.p = env_alloc(Pr.n + Ql.n);
+    cross.n = env_sum(&Pr, &Ql, cross.p);
+
+    both.p = env_alloc(Wl.n + Wr.n);
+    both.n = env_merge(&Wl, &Wr, both.p);
+    W->p = env_alloc(both.n + cross.n);
+    W->n = env_hull(W->p, env_merge(&both, &cross, W->p));
+
+    // P rises with t from left to right, Q with -t from right to left
+    P->p = env_alloc(Pl.n + Pr.n);
+    P->n = env_merge(&Pl, &Pr, P->p);
+    P->n = env_hull(P->p, P->n);
+    Q->p = env_alloc(Qr.n + Ql.n);
+    Q->n = env_merge(&Qr, &Ql, Q->p);
+    Q->n = env_hull(Q->p, Q->n);
+
+    free(Pl.p); free(Ql.p); free(Wl.p);
+    free(Pr.p); free(Qr.p); free(Wr.p);
+    free(cross.p); free(both.p);
+}
+
+// hull of b(r): W.p[0] is (0, b at high rates), W.p[W.n-1] is (length,
+// bytes) of the interval setting b at rate 0. For r between the slopes of
+// the edges on either side of point k, b(r) = W.p[k].y - r * W.p[k].x.
+static void envelope_curve(const struct trace *t, struct env_chain *W)
+{
+    struct env_chain P, Q;
+    double *sum = malloc(t->count*sizeof(double)), s = 0;
+    unsigned long k;
+
+    if(NULL==sum) {
+        fprintf(stderr, "%s cannot allocate %lu sums\n", MODULE, t->count);
+        exit(1);
+    }
+    for(k=0; k<t->count; ++k) {
+        s += t->bytes[k];
+        sum[k] = s;
+    }
+
+    env_hulls(t, sum, 0, t->count, &P, &Q, W);
+    free(P.p);
+    free(Q.p);
+    free(sum);
+}
+
+// startup delay in seconds and buffer in bytes for constant output rate r
+static void cbr_size(const struct trace *t, double r, double *delay, double *buffer)
+{
+    double sum = 0, d = 0, b = 0;
+    unsigned long k;
+
+    for(k=0; k<t->count; ++k) {
+        double sec = t->time_ns[k]/1e9;
+
+        if(sec - sum/r > d) d = sec - sum/r;
+        sum += t->bytes[k];
+    }
+
+    sum = 0;
+    for(k=0; k<t->count; ++k) {
+        double sec = t->time_ns[k]/1e9;
+        double sent = sec>d ? r*(sec-d) : 0;
+
+        sum += t->bytes[k];
+        if(sum - sent > b) b = sum - sent;
+    }
+
+    *delay = d;
+    *buffer = b;
+}
+
+static void report_trace(const struct trace *t)
+{
+    double mean = trace_mean_rate(t);
+    double rate, delay, buffer, first, queue;
+    struct env_chain W;
+    unsigned long k;
+
+    printf("%s: %ld points, %.1f sec, %ld bytes, mean %.0f bytes/sec\n",
+            t->name, t->count, t->count ? t->time_ns[t->count-1]/1e9 : 0,
+            trace_total_bytes(t), mean);
+    if(mean<=0) return;
+
+    // from rate 0 up, burst is linear between these and flat after the last
+    envelope_curve(t, &W);
+    printf("  token bucket envelope, %lu breakpoints, burst linear in between:\n", W.n-1);
+    printf("    %5.2fx %12.0f bytes/sec  burst %12.0f bytes\n", 0.0, 0.0, W.p[W.n-1].y);
+    for(k=W.n-1; k>0; --k) {
+        rate = (W.p[k].y - W.p[k-1].y) / (W.p[k].x - W.p[k-1].x) * 1e9;
+        printf("    %5.2fx %12.0f bytes/sec  burst %12.0f bytes\n",
+                rate/mean, rate, W.p[k-1].y - rate*W.p[k-1].x/1e9);
+    }
+    free(W.p);
+
+    rate = g_out_rate>0 ? g_out_rate : mean*g_out_factor;
+    printf("  token bucket at %.0f bytes/sec: burst %.0f bytes\n",
+            rate, envelope_burst(t, rate));
+    cbr_size(t, rate, &delay, &buffer);
+    first = t->time_ns[0]/1e9;
+    printf("  constant rate %.0f bytes/sec: startup delay %.0f ms after first data, buffer %.0f bytes\n",
+            rate, (delay>first ? delay-first : 0)*1000, buffer);
+
+    // the queue has to hold at least one tick of output. The startup delay
+    // is not smoother3's -d, that is the controller's target buffering
+    // delay, so it is only given as a note.
+    queue = rate*SMOOTHER3_TICK_MS/1000;
+    if(queue < buffer) queue = buffer;
+    if(queue < 1) queue = 1;
+    printf("  smoother3 -q %.0f, start output %.0f ms after first data\n",
+            ceil(queue), (delay>first ? delay-first : 0)*1000);
+}
+
+int main(int argc, char **argv)
+{
+    struct trace *traces;
+    int all = 0, count, i;
+
+    while(1) {
+        int c;
+
+        if( -1 == (c = getopt(argc, argv, "?har:")) ) break;
+
+        switch(c) {
+        case '?':
+        case 'h':
+            fprintf(stderr, "%s [-a] [-r rate] log...\n", argv[0]);
+            fprintf(stderr, "-a also analyze all logs merged into one stream\n");
+            fprintf(stderr, "-r output rate to give token bucket burst and to size buffer for, in bytes/sec,\n");
+            fprintf(stderr, "   or a multiple of each log's mean with suffix x, e.g. 1.1x.\n");
+            fprintf(stderr, "   Default is the mean\n");
+            fprintf(stderr, "\nThis tool computes token bucket envelopes, buffer size and startup delay\n");
+            fprintf(stderr, "from \"time-in-millisecond bytes\" logs of bytelog and bytelog2\n\n");
+            exit(1);
+            break;
+
+        case 'a':
+            all = 1;
+            break;
+
+        case 'r':
+            {
+                char *end;
+                double v = strtod(optarg, &end);
+
+                if(v<=0 || (*end && strcmp(end, "x"))) {
+                    fprintf(stderr, "%s bad rate '%s'\n", MODULE, optarg);
+                    exit(1);
+                }
+                if(*end) g_out_factor = v;
+                else g_out_rate = v;
+            }
+            break;
+        }
+    }
+
+    count = argc - optind;
+    if(count<=0) {
+        fprintf(stderr, "%s Please specify logs to analyze.\n", MODULE);
+        exit(1);
+    }
+
+    traces = calloc(count, sizeof(struct trace));
+    if(NULL==traces) {
+        fprintf(stderr, "%s cannot allocate %d traces\n", MODULE, count);
+        exit(1);
+    }
+
+    for(i=0; i<count; ++i) {
+        if(trace_load(&traces[i], argv[optind+i])<0) {
+            fprintf(stderr, "%s cannot read '%s': %s\n", MODULE, argv[optind+i], strerror(errno));
+            exit(1);
+        }
+        report_trace(&traces[i]);
+    }
+
+    if(all && count>1) {
+        struct trace merged;
+
+        trace_init(&merged, "all merged");
+        if(trace_merge(&merged, traces, count)<0) {
+            fprintf(stderr, "%s cannot merge logs\n", MODULE);
+            exit(1);
+        }
+        report_trace(&merged);
+        trace_free(&merged);
+    }
+
+    for(i=0; i<count; ++i) {
+        trace_free(&traces[i]);
+    }
+    free(traces);
+    return 0;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -8,80 +9,606 @@
 #include <sys/time.h>
 #include <getopt.h>
 #include <signal.h>
+#include <sys/epoll.h>
+
+#include "monoclock.h"
+#include "rate.h"
+
+#define MAX_TEE_OUTPUTS 8
+#define MAX_STREAMS 256
+#define FIRST_REPORT_MS 500
+#define REPORT_PERIOD_MS 2000
 
 int buffer_size = 40*1024;
 int to_quit = 0;
 int show_in_mbit = 0;
 int warn_low_mark = 0, warn_high_mark = 1;
+int zero_copy = 0;
+int tee_fds[MAX_TEE_OUTPUTS];
+int tee_count = 0;
+int tee_failed = 0; // an -o output could not be written, the run stops
+int sample_ms = 0; // rate percentile sampling interval, 0 to disable
 
-// return avrage data rate in number of bytes per second.
-// return zero if duration_sec has not passed since last calculation.
-// contents of pt1 and pt2 will be modified
-unsigned long calculate_byte_rate(struct timeval *pt1, struct timeval *pt2, 
-                    unsigned long *temp_size, int duration_sec)
+// first report comes early from the rate estimator, then one every
+// REPORT_PERIOD_MS. return 1 when a report is due at now_ns.
+static int report_due(long *next_ns, long now_ns)
 {
-    unsigned long average_bytes = 0;
-    unsigned long mili_sec;
+    if(now_ns < *next_ns) return 0;
+    *next_ns = now_ns + REPORT_PERIOD_MS*1000000L;
+    return 1;
+}
 
-    gettimeofday(pt2, NULL);
-    if(pt2->tv_sec < pt1->tv_sec+duration_sec) {
-        goto out;
+void signal_handler(int signo)
+{
+    to_quit = 1;
+}
+
+static void print_rate(unsigned long byte_rate)
+{
+    if(show_in_mbit) fprintf(stderr, " %.2f", ((double)byte_rate*8)/1024/1024);
+    else fprintf(stderr, " %ld", byte_rate);
+}
+
+// print average rate and check it against the warning range low~high.
+// name is printed in front of the lines, "" for single stream.
+// return -1 if rate is out of range.
+int report_byte_rate(const char *name, unsigned long average_bytes, unsigned long total_size,
+                    int low, int high)
+{
+    if( show_in_mbit ) {
+        double mbits = ((double)average_bytes*8)/1024/1024;
+        fprintf(stderr, "%sAvg. %.2f Mbits/sec\n", name, mbits);
+        if(low && high && 
+           (mbits<low || mbits>high)
+          ) {
+            fprintf(stderr, "%sWARNING: bit rate %.2f Mbits out of range, after %ld total bytes\n",
+                    name, mbits, total_size);
+            return -1;
+        }
     }
+    else {
+        fprintf(stderr, "%sAvg. %ld bytes/sec\n", name, average_bytes);
+        if(low && high && 
+           (average_bytes<low || average_bytes>high)
+          ) {
+            fprintf(stderr, "%sWARNING: bit rate %ld MBytes out of range, after %ld total bytes\n",
+                    name, average_bytes, total_size);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// ==========================================================================
+// Rate percentiles: bytes are counted in sample_ms slots, and the rate of
+// every slot goes into a log-linear histogram (HDR style). Slots without
+// data count as zero rate. Memory is fixed, precision is about 1.5%.
+
+#define HIST_SUB_BITS 6
+#define HIST_SUB_COUNT (1<<HIST_SUB_BITS)
+#define HIST_BUCKETS ((64-HIST_SUB_BITS+1)*HIST_SUB_COUNT)
+
+struct rate_hist {
+    unsigned long counts[HIST_BUCKETS];
+    unsigned long total_count;
+    unsigned long max;
+};
+
+struct rate_sampler {
+    struct rate_hist period; // reset at every report
+    struct rate_hist total;
+    long slot_end_ns;
+    unsigned long slot_bytes;
+};
+
+// values below 2*HIST_SUB_COUNT map directly, above that every power of
+// two is split in HIST_SUB_COUNT buckets
+static int hist_index(unsigned long v)
+{
+    int e;
+
+    if(v < 2*HIST_SUB_COUNT) return v;
+    e = 63 - __builtin_clzl(v) - HIST_SUB_BITS;
+    return e*HIST_SUB_COUNT + (v>>e);
+}
+
+// highest value that falls in bucket idx
+static unsigned long hist_value(int idx)
+{
+    int e;
+
+    if(idx < 2*HIST_SUB_COUNT) return idx;
+    e = idx/HIST_SUB_COUNT - 1;
+    return ((unsigned long)(idx%HIST_SUB_COUNT + HIST_SUB_COUNT + 1)<<e) - 1;
+}
+
+static void hist_record(struct rate_hist *h, unsigned long v, unsigned long n)
+{
+    h->counts[hist_index(v)] += n;
+    h->total_count += n;
+    if(v>h->max) h->max = v;
+}
+
+// return the value at percentile pct, 0~100
+static unsigned long hist_percentile(const struct rate_hist *h, double pct)
+{
+    unsigned long want = (unsigned long)(h->total_count*pct/100 + 0.5);
+    unsigned long seen = 0;
+    int i;
+
+    if(want<1) want = 1;
+    for(i=0; i<HIST_BUCKETS; ++i) {
+        seen += h->counts[i];
+        if(seen>=want) {
+            unsigned long v = hist_value(i);
+            return v<h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+struct rate_sampler *rate_sampler_new(void)
+{
+    struct rate_sampler *s = calloc(1, sizeof(*s));
+
+    if(!s) {
+        fprintf(stderr, "cannot allocate rate histogram\n");
+        exit(1);
+    }
+    s->slot_end_ns = mono_now_ns() + sample_ms*1000000L;
+    return s;
+}
+
+// count nbyte arriving now. Slots that ended before now are closed first,
+// idle slots are recorded in one go.
+void rate_sampler_add(struct rate_sampler *s, unsigned long nbyte)
+{
+    long late_ns = mono_now_ns() - s->slot_end_ns;
+
+    if(late_ns>=0) {
+        long slot_ns = sample_ms*1000000L;
+        unsigned long idle = late_ns/slot_ns;
+        unsigned long rate = s->slot_bytes*1000/sample_ms;
+
+        hist_record(&s->period, rate, 1);
+        hist_record(&s->total, rate, 1);
+        if(idle) {
+            hist_record(&s->period, 0, idle);
+            hist_record(&s->total, 0, idle);
+        }
+        s->slot_bytes = 0;
+        s->slot_end_ns += (idle+1)*slot_ns;
+    }
+    s->slot_bytes += nbyte;
+}
+
+static void print_rate_hist(const char *name, const char *what, const struct rate_hist *h)
+{
+    static const double pcts[] = { 50, 90, 99, 99.9 };
+    int i;
 
-    mili_sec = (pt2->tv_sec-pt1->tv_sec)*1000;            
+    if(!h->total_count) return;
 
-    if(pt2->tv_usec>=pt1->tv_usec) {
-        mili_sec += (pt2->tv_usec-pt1->tv_usec)/1000;
+    fprintf(stderr, "%s%s", name, what);
+    for(i=0; i<sizeof(pcts)/sizeof(pcts[0]); ++i) {
+        unsigned long v = hist_percentile(h, pcts[i]);
+        if(show_in_mbit) fprintf(stderr, " p%g %.2f", pcts[i], ((double)v*8)/1024/1024);
+        else fprintf(stderr, " p%g %ld", pcts[i], v);
+    }
+    if(show_in_mbit) {
+        fprintf(stderr, " max %.2f Mbits/sec, %ld x %d ms\n",
+                ((double)h->max*8)/1024/1024, h->total_count, sample_ms);
     }
     else {
-        mili_sec -= 1000;
-        mili_sec += (pt2->tv_usec+1000000-pt1->tv_usec)/1000;
+        fprintf(stderr, " max %ld bytes/sec, %ld x %d ms\n",
+                h->max, h->total_count, sample_ms);
     }
+}
 
-    if(!mili_sec) {
-        fprintf(stderr, "internal exception!\n");
-        goto out;
+// print percentiles of the period and start a new one
+void rate_sampler_report(struct rate_sampler *s, const char *name)
+{
+    rate_sampler_add(s, 0);
+    print_rate_hist(name, "Pct.", &s->period);
+    memset(&s->period, 0, sizeof(s->period));
+}
+
+void rate_sampler_report_total(struct rate_sampler *s, const char *name)
+{
+    rate_sampler_add(s, 0);
+    print_rate_hist(name, "Total pct.", &s->total);
+}
+
+// End of rate percentiles
+// ==========================================================================
+
+// print the 1s rate as average, followed by all windows and EWMAs.
+// Warnings are checked once the 1s window is full.
+int report_rates(const char *name, struct rate_est *r, unsigned long total_size,
+                    int low, int high)
+{
+    long now = mono_now_ns();
+    int w;
+
+    fprintf(stderr, "%sWin.", name);
+    for(w=0; w<e_Rate_WindowMax; ++w) {
+        fprintf(stderr, " %s", rate_window_names[w]);
+        print_rate(rate_est_window(r, w, now));
+    }
+    fprintf(stderr, ", EWMA");
+    for(w=e_Rate_1s; w<e_Rate_WindowMax; ++w) {
+        fprintf(stderr, " %s", rate_window_names[w]);
+        print_rate(rate_est_ewma(r, w, now));
     }
+    fprintf(stderr, show_in_mbit ? " Mbits/sec\n" : " bytes/sec\n");
 
-    average_bytes = (*temp_size*1000) / mili_sec;
-//    fprintf(stderr, "Avg. %ld bytes/sec\n", average_bytes);
+    if(!rate_est_ready(r, e_Rate_1s, now)) low = 0;
+    return report_byte_rate(name, rate_est_window(r, e_Rate_1s, now), total_size, low, high);
+}
 
-    // reset
-    *temp_size = 0;
-    *pt1 = *pt2;
+static int is_pipe(int fd)
+{
+    struct stat st;
 
-out:
-        return average_bytes;
+    if(fstat(fd, &st)<0) return 0;
+    return S_ISFIFO(st.st_mode);
 }
 
-void signal_handler(int signo)
+// write all of buf to fd, retry on short write.
+static int write_all(int fd, const unsigned char *buf, size_t nbyte)
 {
-    to_quit = 1;
+    while(nbyte) {
+        ssize_t ret = write(fd, buf, nbyte);
+        if(ret<0) {
+            if(EINTR==errno) continue;
+            return -1;
+        }
+        buf += ret;
+        nbyte -= ret;
+    }
+    return 0;
+}
+
+// duplicate nbyte bytes sitting in pipe 'mid' to tee output 'outfd'.
+// tee() may link fewer bytes than asked when outfd is nearly full, and
+// it always starts from the head of 'mid', so the missing tail is
+// copied through scratch pipe and user space. This is the slow path.
+static int tee_to_output(int mid, int outfd, size_t nbyte,
+                        int scratch[2], unsigned char *buf)
+{
+    ssize_t ret;
+    size_t done = 0, got = 0;
+
+    ret = tee(mid, outfd, nbyte, 0);
+    if(ret<0) return -1;
+    if((size_t)ret==nbyte) return 0;
+    done = ret;
+
+    // scratch is empty and as large as mid, tee fits in one go
+    ret = tee(mid, scratch[1], nbyte, 0);
+    if((size_t)ret!=nbyte) return -1;
+    while(got<nbyte) {
+        ret = read(scratch[0], buf+got, nbyte-got);
+        if(ret<=0) return -1;
+        got += ret;
+    }
+
+    return write_all(outfd, buf+done, nbyte-done);
+}
+
+// move data from stdin to stdout inside the kernel, only counting the
+// lengths. Data is tee()'d to every extra output before it is spliced
+// to stdout.
+// return total bytes moved.
+unsigned long splice_loop(unsigned char *buf)
+{
+    unsigned long total_size = 0;
+    struct rate_est est;
+    long next_report;
+    int mid[2] = {-1, -1}, scratch[2] = {-1, -1};
+    int src = 0;
+    struct rate_sampler *sampler = sample_ms ? rate_sampler_new() : NULL;
+
+    if(tee_count) {
+        if(pipe(mid)<0 || pipe(scratch)<0) {
+            fprintf(stderr, "cannot create pipe: %s\n", strerror(errno));
+            exit(1);
+        }
+        fcntl(mid[1], F_SETPIPE_SZ, buffer_size);
+        fcntl(scratch[1], F_SETPIPE_SZ, fcntl(mid[1], F_GETPIPE_SZ));
+        src = mid[0];
+    }
+
+    next_report = mono_now_ns();
+    rate_est_init(&est, next_report);
+    next_report += FIRST_REPORT_MS*1000000L;
+
+    while(!to_quit) {
+        ssize_t sizer, moved;
+        long now;
+        int i;
+
+        if(tee_count) {
+            sizer = splice(0, NULL, mid[1], NULL, buffer_size, SPLICE_F_MOVE);
+        }
+        else {
+            sizer = splice(0, NULL, 1, NULL, buffer_size, SPLICE_F_MOVE|SPLICE_F_MORE);
+        }
+        if(sizer<0) {
+            if(EINTR==errno) continue;
+            fprintf(stderr, "splice failed: %s\n", strerror(errno));
+            break;
+        }
+        else if(sizer==0) {
+            break; // EOF
+        }
+
+        for(i=0; i<tee_count; ++i) {
+            if(tee_to_output(mid[0], tee_fds[i], sizer, scratch, buf)<0) {
+                fprintf(stderr, "tee to output %d failed: %s\n", i, strerror(errno));
+                tee_failed = 1;
+                to_quit = 1;
+            }
+        }
+
+        // data from stdin went straight to stdout when there is no tee
+        for(moved = tee_count ? 0 : sizer; moved<sizer; ) {
+            ssize_t ret = splice(src, NULL, 1, NULL, sizer-moved, SPLICE_F_MOVE|SPLICE_F_MORE);
+            if(ret<=0) {
+                if(ret<0 && EINTR==errno) continue;
+                fprintf(stderr, "splice to stdout failed: %s\n", strerror(errno));
+                to_quit = 1;
+                break;
+            }
+            moved += ret;
+        }
+
+        total_size += (unsigned long)sizer;
+        if(sampler) rate_sampler_add(sampler, sizer);
+
+        now = mono_now_ns();
+        rate_est_add(&est, sizer, now);
+        if(!report_due(&next_report, now)) { // not time to report yet
+            continue;
+        }
+        if(sampler) rate_sampler_report(sampler, "");
+        if(report_rates("", &est, total_size, warn_low_mark, warn_high_mark)<0) {
+            break; //quit
+        }
+    }
+
+    if(sampler) {
+        rate_sampler_report_total(sampler, "");
+        free(sampler);
+    }
+
+    if(tee_count) {
+        close(mid[0]);
+        close(mid[1]);
+        close(scratch[0]);
+        close(scratch[1]);
+    }
+    return total_size;
+}
+
+// ==========================================================================
+// Multi-stream metering: inputs named on command line are all read by one
+// epoll loop. Every input is "path[=output][@low:high]"; data is copied to
+// output if given, otherwise discarded. Warnings do not stop the loop.
+
+struct meter_stream {
+    char name[64];
+    int fd;
+    int out_fd;
+    int low, high; // warning range
+    int pollable; // regular files can not be polled, they are always ready
+    int eof;
+    unsigned long total_size;
+    struct rate_est est;
+    unsigned long warnings;
+    struct rate_sampler *sampler; // NULL without -p
+};
+
+static void parse_stream_spec(struct meter_stream *s, char *spec)
+{
+    char *out = NULL, *range;
+
+    memset(s, 0, sizeof(*s));
+    s->out_fd = -1;
+    s->low = warn_low_mark;
+    s->high = warn_high_mark;
+
+    range = strchr(spec, '@');
+    if(range) {
+        char *c = strchr(range+1, ':');
+        *range = 0;
+        if(c) {
+            s->low = atoi(range+1);
+            s->high = atoi(c+1);
+        }
+    }
+    out = strchr(spec, '=');
+    if(out) {
+        *out++ = 0;
+    }
+
+    snprintf(s->name, sizeof(s->name), "[%s] ", spec);
+
+    s->fd = open(spec, O_RDONLY|O_NONBLOCK);
+    if(s->fd<0) {
+        fprintf(stderr, "cannot open '%s' for reading: %s\n", spec, strerror(errno));
+        exit(1);
+    }
+    if(out) {
+        s->out_fd = open(out, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+        if(s->out_fd<0) {
+            fprintf(stderr, "cannot open '%s' for writing: %s\n", out, strerror(errno));
+            exit(1);
+        }
+    }
 }
 
+// read what is available from one stream, return -1 on EOF or error
+static int meter_stream_read(struct meter_stream *s, unsigned char *buf)
+{
+    while(1) {
+        ssize_t sizer = read(s->fd, buf, buffer_size);
+
+        if(sizer>0) {
+            s->total_size += sizer;
+            rate_est_add(&s->est, sizer, mono_now_ns());
+            if(s->sampler) rate_sampler_add(s->sampler, sizer);
+            if(s->out_fd>=0) write_all(s->out_fd, buf, sizer);
+            // regular file: one buffer at a time so others get their turn
+            if(!s->pollable) return 0;
+            continue;
+        }
+        if(0==sizer) return -1;
+        if(EINTR==errno) continue;
+        if(EAGAIN==errno || EWOULDBLOCK==errno) return 0;
+
+        fprintf(stderr, "%sread failed: %s\n", s->name, strerror(errno));
+        return -1;
+    }
+}
+
+// meter all streams, return total bytes of all streams
+unsigned long multi_loop(int count, char **specs, unsigned char *buf)
+{
+    static struct meter_stream streams[MAX_STREAMS];
+    struct epoll_event events[64];
+    unsigned long total_size = 0;
+    long next_report;
+    int epfd, i, active = 0, always_ready = 0;
+
+    if(count>MAX_STREAMS) {
+        fprintf(stderr, "too many inputs, at most %d\n", MAX_STREAMS);
+        exit(1);
+    }
+
+    epfd = epoll_create1(0);
+    if(epfd<0) {
+        fprintf(stderr, "epoll_create failed: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    for(i=0; i<count; ++i) {
+        struct meter_stream *s = &streams[i];
+        struct epoll_event ev;
+
+        parse_stream_spec(s, specs[i]);
+        if(sample_ms) s->sampler = rate_sampler_new();
+        ev.events = EPOLLIN;
+        ev.data.ptr = s;
+        s->pollable = epoll_ctl(epfd, EPOLL_CTL_ADD, s->fd, &ev)==0;
+        if(!s->pollable) always_ready++;
+        active++;
+    }
+    fprintf(stderr, "Metering %d inputs\n", count);
+
+    next_report = mono_now_ns();
+    for(i=0; i<count; ++i) {
+        rate_est_init(&streams[i].est, next_report);
+    }
+    next_report += FIRST_REPORT_MS*1000000L;
+
+    while(!to_quit && active) {
+        long wait_ms;
+        int n;
+
+        // wake up for the next report, or poll only if files are waiting
+        wait_ms = (next_report - mono_now_ns())/1000000L;
+        if(wait_ms<0 || always_ready) wait_ms = 0;
+
+        n = epoll_wait(epfd, events, sizeof(events)/sizeof(events[0]), wait_ms);
+        if(n<0 && EINTR!=errno) {
+            fprintf(stderr, "epoll_wait failed: %s\n", strerror(errno));
+            break;
+        }
+
+        for(i=0; i<n; ++i) {
+            struct meter_stream *s = (struct meter_stream *)events[i].data.ptr;
+
+            if(meter_stream_read(s, buf)<0) {
+                epoll_ctl(epfd, EPOLL_CTL_DEL, s->fd, NULL);
+                s->eof = 1;
+                active--;
+            }
+        }
+        for(i=0; i<count && always_ready; ++i) {
+            struct meter_stream *s = &streams[i];
+
+            if(s->pollable || s->eof) continue;
+            if(meter_stream_read(s, buf)<0) {
+                s->eof = 1;
+                active--;
+                always_ready--;
+            }
+        }
+
+        // report every stream each period
+        if(!report_due(&next_report, mono_now_ns())) continue;
+
+        for(i=0; i<count; ++i) {
+            struct meter_stream *s = &streams[i];
+
+            if(s->eof) continue;
+            if(s->sampler) rate_sampler_report(s->sampler, s->name);
+            if(report_rates(s->name, &s->est, s->total_size, s->low, s->high)<0) {
+                s->warnings++;
+            }
+        }
+    }
+
+    for(i=0; i<count; ++i) {
+        struct meter_stream *s = &streams[i];
+
+        fprintf(stderr, "%sTotal %ld bytes read, %ld warnings\n", s->name,
+                s->total_size, s->warnings);
+        if(s->sampler) {
+            rate_sampler_report_total(s->sampler, s->name);
+            free(s->sampler);
+        }
+        total_size += s->total_size;
+        close(s->fd);
+        if(s->out_fd>=0) close(s->out_fd);
+    }
+    close(epfd);
+
+    return total_size;
+}
+
+// End of multi-stream metering
+// ==========================================================================
+
 int main(int argc, char **argv)
 {
 	unsigned char *buf;
-    FILE *inf;
-    FILE *outf;
 	unsigned long total_size = 0;
-    unsigned long temp_size = 0;
-    struct timeval t1, t2;
-    int counter=0;
+    struct rate_est est;
+    long next_report;
+    struct rate_sampler *sampler = NULL;
 
     while(1) {
         int c;
 
-        if( -1 == (c = getopt(argc, argv, "?hmb:w:")) ) break;
+        if( -1 == (c = getopt(argc, argv, "?hmzb:w:o:p:")) ) break;
 
         switch(c) {
         case '?':
         case 'h':
-            fprintf(stderr, "%s [-b buffer_size] [-m] [-w low:high]\n", argv[0]);
+            fprintf(stderr, "%s [-b buffer_size] [-m] [-w low:high] [-z] [-o output]... [-p sample_ms] [input...]\n", argv[0]);
             fprintf(stderr, "buffer size default %d bytes\n", buffer_size);
             fprintf(stderr, "-m show in mega-bits\n");
             fprintf(stderr, "-w post warning if stream bit rate is out of range.\n");
             fprintf(stderr, "   format is \"time-in-millisecond bytes\" perline\n");
+            fprintf(stderr, "-z zero-copy with splice() when stdin and stdout are pipes\n");
+            fprintf(stderr, "-o also copy data to this file or FIFO, up to %d times\n", MAX_TEE_OUTPUTS);
+            fprintf(stderr, "-p also print p50/p90/p99/p99.9/max of rates sampled every sample_ms, e.g. 10\n");
+            fprintf(stderr, "input is path[=output][@low:high], meter all inputs at once instead of stdin.\n");
+            fprintf(stderr, "   path is a FIFO, file or /dev/fd/N. Data is copied to output if given.\n");
+            fprintf(stderr, "   low:high overrides -w for this input. Warnings do not stop metering.\n");
             fprintf(stderr, "\nThis tool calculates bytes flow from stdin and copy data to stdout\n\n");
             exit(1);
             break;
@@ -104,7 +631,33 @@ int main(int argc, char **argv)
                 warn_low_mark = atoi(optarg);
                 warn_high_mark = atoi(c2);
             }
+            break;
+
+        case 'p':
+            sample_ms = atoi(optarg);
+            if(sample_ms<=0) {
+                fprintf(stderr, "invalid sample interval '%s'\n", optarg);
+                exit(1);
+            }
+            break;
+
+        case 'z':
+            zero_copy = 1;
+            break;
 
+        case 'o':
+            if(tee_count>=MAX_TEE_OUTPUTS) {
+                fprintf(stderr, "too many outputs, at most %d\n", MAX_TEE_OUTPUTS);
+                exit(1);
+            }
+            tee_fds[tee_count] = open(optarg, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+            if(tee_fds[tee_count]<0) {
+                fprintf(stderr, "cannot open '%s' for writing: %s\n",
+                        optarg, strerror(errno));
+                exit(1);
+            }
+            tee_count++;
+            break;
         }
     }
 
@@ -115,73 +668,94 @@ int main(int argc, char **argv)
                 warn_low_mark, warn_high_mark);
     }
 
-    inf = fopen("/dev/stdin", "r");
-    if(!inf) {
-        fprintf(stderr, "cannot open /dev/stdin for reading\n");
-        exit(1);
-    }
-
-    outf = fopen("/dev/stdout", "w");
-    if(!outf) {
-        fprintf(stderr, "cannot open /dev/stdout for writing\n");
-        exit(1);
-    }
-
     buf = malloc(buffer_size);
     if(!buf) {
         fprintf(stderr, "cannot allocate buffer of %d bytes\n", buffer_size);
         exit(1);
     }
 
+    mono_clock_init();
     signal(SIGINT, signal_handler);
+    // a dead -o reader is reported and stops the run, instead of killing it
+    if(tee_count) signal(SIGPIPE, SIG_IGN);
 
-    gettimeofday(&t1, NULL);
+    if(optind<argc) {
+        total_size = multi_loop(argc-optind, argv+optind, buf);
+        goto out;
+    }
 
-	while(!to_quit) {
-        size_t sizer, sizew;
-        unsigned long average_bytes;
+    // zero-copy only works between pipes, otherwise use the copy loop below
+    if(zero_copy) {
+        int i, all_pipes = is_pipe(0) && is_pipe(1);
 
-        sizer = fread(buf, 1, buffer_size, inf);
+        for(i=0; i<tee_count; ++i) {
+            all_pipes = all_pipes && is_pipe(tee_fds[i]);
+        }
+        if(all_pipes) {
+            fprintf(stderr, "Use zero-copy splice\n");
+            total_size = splice_loop(buf);
+            goto out;
+        }
+        fprintf(stderr, "Not all ends are pipes, fall back to copy\n");
+    }
 
-        total_size += (unsigned long)sizer;
-        temp_size += (unsigned long)sizer;
+    if(sample_ms) sampler = rate_sampler_new();
+    next_report = mono_now_ns();
+    rate_est_init(&est, next_report);
+    next_report += FIRST_REPORT_MS*1000000L;
 
-        average_bytes = calculate_byte_rate(&t1, &t2, &temp_size, 2);
+	while(!to_quit) {
+        ssize_t sizer;
+        long now;
+        int i;
 
-        if(0==average_bytes) { // not time to calculate yet
-            continue;
+        // take what one read gives, fread() would wait for a full buffer
+        // and the sampled rates would follow buffer_size, not the stream
+        sizer = read(0, buf, buffer_size);
+        if(sizer<0) {
+            if(EINTR==errno) continue;
+            fprintf(stderr, "read failed: %s\n", strerror(errno));
+            break;
+        }
+        else if(sizer==0) {
+            break; // EOF
         }
-        else if(counter++<3) { // ignore the initial numbers for more correct results
-            //fprintf(stderr, "Ignore calc. %d\n", counter);
+
+        if(write_all(1, buf, sizer)<0) {
+            fprintf(stderr, "write to stdout failed: %s\n", strerror(errno));
+            break;
+        }
+        for(i=0; i<tee_count; ++i) {
+            if(write_all(tee_fds[i], buf, sizer)<0) {
+                fprintf(stderr, "write to output %d failed: %s\n", i, strerror(errno));
+                tee_failed = 1;
+                to_quit = 1;
+            }
+        }
+
+        total_size += (unsigned long)sizer;
+        if(sampler) rate_sampler_add(sampler, sizer);
+
+        now = mono_now_ns();
+        rate_est_add(&est, sizer, now);
+        if(!report_due(&next_report, now)) { // not time to report yet
             continue;
         }
-        else if( show_in_mbit ) {
-                double mbits = ((double)average_bytes*8)/1024/1024;
-                fprintf(stderr, "Avg. %.2f Mbits/sec\n", mbits);
-                if(warn_low_mark && warn_high_mark && 
-                   (mbits<warn_low_mark || mbits>warn_high_mark)
-                  ) {
-                    fprintf(stderr, "WARNING: bit rate %.2f Mbits out of range, after %ld total bytes\n",
-                            mbits, total_size);
-                    break; //quit
-                }
+        if(sampler) rate_sampler_report(sampler, "");
+        if(report_rates("", &est, total_size, warn_low_mark, warn_high_mark)<0) {
+            break; //quit
         }
-        else {
-                fprintf(stderr, "Avg. %ld bytes/sec\n", average_bytes);
-                if(warn_low_mark && warn_high_mark && 
-                   (average_bytes<warn_low_mark || average_bytes>warn_high_mark)
-                  ) {
-                    fprintf(stderr, "WARNING: bit rate %ld MBytes out of range, after %ld total bytes\n",
-                            average_bytes, total_size);
-                    break; //quit
-                }
-        }
-        
-        sizew = fwrite(buf, 1, sizer, outf);
 	} // end of while loop
 
+    if(sampler) {
+        rate_sampler_report_total(sampler, "");
+        free(sampler);
+    }
+
+out:
 	fprintf(stderr, "Total %ld bytes read\n", total_size);
-    fclose(inf);
-    fclose(outf);
-	return 0;
+    while(tee_count--) {
+        close(tee_fds[tee_count]);
+    }
+	return tee_failed ? 1 : 0;
 }
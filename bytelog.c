@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -5,10 +6,15 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
-#include <sys/time.h>
 #include <getopt.h>
 #include <signal.h>
 
+#include "monoclock.h"
+#include "logwriter.h"
+
+#define CAPTURE_BUFFER_DEFAULT (1024*1024)
+#define CAPTURE_MERGE_US_DEFAULT 50
+
 int buffer_size = 4*1024;
 int to_quit = 0;
 
@@ -17,55 +23,145 @@ void signal_handler(int signo)
     to_quit = 1;
 }
 
-unsigned long get_time_interval_in_ms(const struct timeval *pt1,
-                        const struct timeval *pt2)
+static int is_pipe(int fd)
 {
-    unsigned long diff_in_ms;
+    struct stat st;
+    return 0==fstat(fd, &st) && S_ISFIFO(st.st_mode);
+}
 
-    diff_in_ms = (pt2->tv_sec - pt1->tv_sec)*1000;
-    
-    if(pt2->tv_usec < pt1->tv_usec) {
-        diff_in_ms -= 1000; // borrow 1 second to pt2
-        diff_in_ms += (pt2->tv_usec+1000000 - pt1->tv_usec)/1000;
+// write all of buf to fd, retry on short write.
+static int write_all(int fd, const unsigned char *buf, size_t nbyte)
+{
+    while(nbyte) {
+        ssize_t ret = write(fd, buf, nbyte);
+        if(ret<0) {
+            if(EINTR==errno) continue;
+            return -1;
+        }
+        buf += ret;
+        nbyte -= ret;
     }
-    else {
-        diff_in_ms += (pt2->tv_usec-pt1->tv_usec)/1000;
+    return 0;
+}
+
+// Capture: log every read with the time it returned. Unlike fread(),
+// read() and splice() return as soon as any data is there, so the records
+// follow the bursts of the writer rather than the buffer size, and replay
+// as they came. Between pipes data is spliced and never copied to user
+// space; the stdin pipe is grown to buffer_size so a burst is taken whole.
+//
+// The kernel wakes a pipe reader while a large write is still being
+// copied in, so one write of the sender may come as several reads
+// microseconds apart. Such reads are logged as one record, at the time
+// of the last: a read joins the record when it comes within merge_ns of
+// the previous read and of the first read of the record, so a steady
+// stream of small writes is never merged into long records.
+// return total bytes moved.
+static unsigned long capture_loop(unsigned char *buf, struct log_writer *logw,
+                        long t_start, long merge_ns)
+{
+    unsigned long total_size = 0, pending = 0;
+    int use_splice = is_pipe(0) && is_pipe(1);
+    long now = t_start, last = t_start, first = t_start;
+
+    if(use_splice) fcntl(0, F_SETPIPE_SZ, buffer_size);
+    fprintf(stderr, "Capture every read with %s\n", use_splice ? "splice" : "read");
+
+    while(!to_quit) {
+        ssize_t sizer;
+
+        if(use_splice) sizer = splice(0, NULL, 1, NULL, buffer_size, SPLICE_F_MOVE|SPLICE_F_MORE);
+        else sizer = read(0, buf, buffer_size);
+        now = mono_now_ns();
+
+        if(sizer<0) {
+            if(EINTR==errno) continue;
+            fprintf(stderr, "%s failed: %s\n", use_splice ? "splice" : "read", strerror(errno));
+            break;
+        }
+        else if(sizer==0) {
+            break; // EOF
+        }
+
+        if(!use_splice && write_all(1, buf, sizer)<0) {
+            fprintf(stderr, "write failed: %s\n", strerror(errno));
+            break;
+        }
+        total_size += sizer;
+
+        // bytes of a dropped record are carried into the next one
+        if(pending && (now-last>merge_ns || now-first>merge_ns)) {
+            if(0==log_writer_push(logw, last-t_start, pending)) pending = 0;
+        }
+        if(0==pending) first = now;
+        pending += sizer;
+        last = now;
     }
 
-    return diff_in_ms;
+    if(pending) log_writer_push(logw, last-t_start, pending);
+    return total_size;
 }
 
 int main(int argc, char **argv)
 {
 	unsigned char *buf;
-    FILE *inf;
-    FILE *outf;
     FILE *logf = NULL;
+    struct log_writer logw;
+    int capture = 0, buffer_set = 0;
+    int merge_us = CAPTURE_MERGE_US_DEFAULT;
+    enum trace_format log_format = e_Trace_TextMs;
+    int log_events = 0;
 	unsigned long interval_size = 0;
     unsigned long total_size = 0;
-    struct timeval t1, t2, t_start;
+    long t1, t2, t_start;
 
     while(1) {
         int c;
 
-        if( -1 == (c = getopt(argc, argv, "?hb:s:")) ) break;
+        if( -1 == (c = getopt(argc, argv, "?hb:cem:s:")) ) break;
 
         switch(c) {
         case '?':
         case 'h':
-            fprintf(stderr, "%s -s file\n", argv[0]);
+            fprintf(stderr, "%s [-c|-e] [-b buffer_size] -s file\n", argv[0]);
             fprintf(stderr, "-s generate time and data size to log file\n");
-            fprintf(stderr, "   format is \"time-in-millisecond bytes\" perline\n");
+            fprintf(stderr, "   format is \"time-in-millisecond bytes\" perline,\n");
+            fprintf(stderr, "   or a binary trace if file ends with .btr\n");
+            fprintf(stderr, "-e log every read as \"time-in-nanosecond bytes\" instead of\n");
+            fprintf(stderr, "   200 ms totals\n");
+            fprintf(stderr, "-c capture a replayable trace: log every read as it arrives,\n");
+            fprintf(stderr, "   forward with splice() between pipes. Default buffer %d bytes\n",
+                    CAPTURE_BUFFER_DEFAULT);
+            fprintf(stderr, "-m with -c, log reads within this many micro seconds of each\n");
+            fprintf(stderr, "   other as one, default %d\n", CAPTURE_MERGE_US_DEFAULT);
+            fprintf(stderr, "-b read size, default %d bytes\n", buffer_size);
             fprintf(stderr, "\nThis tool calculates bytes flow from stdin and copy data to stdout\n\n");
             exit(1);
             break;
 
         case 'b':
             buffer_size = atoi(optarg);
+            buffer_set = 1;
+            break;
+
+        case 'c':
+            capture = 1;
+            log_events = 1;
+            break;
+
+        case 'e':
+            log_events = 1;
+            break;
+
+        case 'm':
+            merge_us = atoi(optarg);
             break;
 
         case 's':
             {
+                if(e_Trace_Binary==trace_format_for_path(optarg)) {
+                    log_format = e_Trace_Binary;
+                }
                 logf = fopen(optarg, "w");
                 if(NULL==logf) {
                     fprintf(stderr, "cannot open '%s' for writing: %s\n",
@@ -83,20 +179,9 @@ int main(int argc, char **argv)
         exit(1);
     }
 
+    if(capture && !buffer_set) buffer_size = CAPTURE_BUFFER_DEFAULT;
     fprintf(stderr, "Use buffer %d bytes\n", buffer_size);
     
-    inf = fopen("/dev/stdin", "r");
-    if(!inf) {
-        fprintf(stderr, "cannot open /dev/stdin for reading\n");
-        exit(1);
-    }
-
-    outf = fopen("/dev/stdout", "w");
-    if(!outf) {
-        fprintf(stderr, "cannot open /dev/stdout for writing\n");
-        exit(1);
-    }
-
     buf = malloc(buffer_size);
     if(!buf) {
         fprintf(stderr, "cannot allocate buffer of %d bytes\n", buffer_size);
@@ -105,43 +190,68 @@ int main(int argc, char **argv)
 
     signal(SIGINT, signal_handler);
 
-    fprintf(logf, "time-in-ms bytes\n");
+    if(log_events && e_Trace_TextMs==log_format) log_format = e_Trace_TextNs;
+
+    // the log file is only touched by the writer thread from here on
+    if(log_writer_open(&logw, logf, log_format, LOG_RING_RECORDS_DEFAULT)<0) {
+        exit(1);
+    }
+
+    mono_clock_init();
+    t_start = mono_now_ns();
+    t1 = t_start;
 
-    gettimeofday(&t_start, NULL);
-    gettimeofday(&t1, NULL);
+    if(capture) {
+        total_size = capture_loop(buf, &logw, t_start, merge_us*1000L);
+        goto out;
+    }
 
     // calculate the byte count every specified milli-second
 	while(!to_quit) {
-        size_t sizer, sizew;
+        ssize_t sizer;
         unsigned long time_diff_millisec;
 
-        sizer = fread(buf, 1, buffer_size, inf);
-        gettimeofday(&t2, NULL);
+        // one record per read() with -e, fread() would wait for a full
+        // buffer and log buffer_size at the time it filled
+        sizer = read(0, buf, buffer_size);
+        t2 = mono_now_ns();
+        if(sizer<0) {
+            if(EINTR==errno) continue;
+            fprintf(stderr, "read failed: %s\n", strerror(errno));
+            break;
+        }
+        else if(sizer==0) {
+            break; // EOF
+        }
 
         interval_size += (unsigned long)sizer;
         total_size += (unsigned long)sizer;
 
 
-        time_diff_millisec = get_time_interval_in_ms(&t1, &t2);
+        time_diff_millisec = mono_interval_in_ms(t1, t2);
 
-        if( time_diff_millisec >= 200 ) {
+        if( log_events ? sizer>0 : time_diff_millisec >= 200 ) {
 
-            unsigned long time_diff_from_start = get_time_interval_in_ms(&t_start, &t2);
-
-            fprintf(logf, "%ld %ld\n", time_diff_from_start, interval_size);
-            fflush(logf);
-
-            // reset
-            interval_size = 0;
-            gettimeofday(&t1, NULL);
+            // when the writer can not keep up the record is dropped, and
+            // its bytes are carried into the next one
+            if(0==log_writer_push(&logw, t2-t_start, interval_size)) {
+                interval_size = 0;
+            }
+            t1 = t2;
         }
 
-        sizew = fwrite(buf, 1, sizer, outf);
+        if(write_all(1, buf, sizer)<0) {
+            fprintf(stderr, "write failed: %s\n", strerror(errno));
+            break;
+        }
 	} // end of while loop
 
+    // bytes since the last record, including any carried over from drops
+    if(interval_size>0) log_writer_push(&logw, mono_now_ns()-t_start, interval_size);
+
+out:
 	fprintf(stderr, "Total %ld bytes read\n", total_size);
-    fclose(inf);
-    fclose(outf);
-    fclose(logf);
+    log_writer_close(&logw);
+    fprintf(stderr, "Log %lu records written, %lu dropped\n", logw.written, logw.dropped);
 	return 0;
 }
@@ -10,159 +10,553 @@
 #include <sys/select.h>
 #include <math.h>
 #include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "monoclock.h"
+#include "validate.h"
+#include "trace.h"
 
 #define MODULE "[bytelog2]"
 
-struct log_sample {
-    unsigned long time_ms;
-    unsigned long bytes;
+static int g_buffer_size = 4*1024;
+static int g_to_quit = 0;
+static int g_run_time = 0;
+static int g_validators = -1; // -1: one less than online CPUs
+static int g_keep_going = 0; // account for errors instead of quitting
+
+// ==========================================================================
+// Streaming report: reads are summed into bins at every resolution given
+// by -g, in one pass. A read's bin is its time stamp divided by the
+// resolution, and empty bins are written as zeros, so stalls show up in
+// the series. Each bin is written to its log as soon as it closes, and
+// only running statistics are kept, so memory does not grow with run time.
+
+#define MAX_RESOLUTIONS 8
+
+// Welford mean and variance; the mean update is Kahan compensated so a
+// long run of small corrections does not get lost in rounding
+struct stream_stats {
+    unsigned long count;
+    double mean;
+    double mean_comp; // Kahan compensation of mean
+    double m2; // sum of squared differences to the mean
+    unsigned long min, max;
+};
+
+static void stats_add(struct stream_stats *st, unsigned long x)
+{
+    double delta = (double)x - st->mean;
+    double y, t;
+
+    st->count++;
+    y = delta/st->count - st->mean_comp;
+    t = st->mean + y;
+    st->mean_comp = (t - st->mean) - y;
+    st->mean = t;
+    st->m2 += delta * ((double)x - st->mean);
+
+    if(1==st->count || x<st->min) st->min = x;
+    if(x>st->max) st->max = x;
+}
+
+// add n samples of value x at once, by merging their statistics
+// (Chan et al.), for runs of empty bins
+static void stats_add_n(struct stream_stats *st, unsigned long x, unsigned long n)
+{
+    double delta, total;
 
-    struct log_sample *prev;
-    struct log_sample *next;
+    if(0==n) return;
+    if(1==n || 0==st->count) {
+        stats_add(st, x);
+        stats_add_n(st, x, n-1);
+        return;
+    }
+
+    total = st->count + n;
+    delta = (double)x - st->mean;
+    st->mean += delta * n / total;
+    st->m2 += delta * delta * st->count * n / total;
+    st->count += n;
+    if(x<st->min) st->min = x;
+    if(x>st->max) st->max = x;
+}
+
+static double stats_stddev(const struct stream_stats *st)
+{
+    return st->count ? sqrt(st->m2/st->count) : 0;
+}
+
+struct bin_series {
+    unsigned long res_ns;
+    FILE *logf;
+    struct trace_writer out;
+    unsigned long index; // bin being filled, time/res_ns
+    unsigned long bytes;
+    struct stream_stats stats;
 };
 
-static struct log_sample *g_head, *g_tail;
+static struct bin_series g_series[MAX_RESOLUTIONS];
+static int g_series_count;
+static unsigned long g_sample_count;
 
-static int g_buffer_size = 4*1024;
-static int g_to_quit = 0;
-static int g_granularity = 100;
-static int g_run_time = 0;
+// first log gets path, the others path.<res>ms, or path-stem.<res>ms.btr
+// for binary traces
+static void init_sample_log(const char *path, const int *res_ms, int count)
+{
+    enum trace_format format = trace_format_for_path(path);
+    int i;
+
+    for(i=0; i<count; ++i) {
+        struct bin_series *b = &g_series[i];
+        char name[4096];
+
+        if(0==i) snprintf(name, sizeof(name), "%s", path);
+        else if(e_Trace_Binary==format) {
+            snprintf(name, sizeof(name), "%.*s.%dms.btr", (int)strlen(path)-4, path, res_ms[i]);
+        }
+        else snprintf(name, sizeof(name), "%s.%dms", path, res_ms[i]);
+
+        memset(b, 0, sizeof(*b));
+        b->res_ns = res_ms[i]*1000000UL;
+        b->logf = fopen(name, "w+");
+        if(NULL==b->logf) {
+            fprintf(stderr, "%s cannot open '%s' for writing: %s\n",
+                    MODULE, name, strerror(errno));
+            exit(1);
+        }
+        if(trace_writer_open(&b->out, b->logf, format)<0) {
+            fprintf(stderr, "%s cannot write '%s': %s\n", MODULE, name, strerror(errno));
+            exit(1);
+        }
+        fflush(b->logf);
+    }
+    g_series_count = count;
+    g_sample_count = 0;
+}
 
-static void init_sample_log(void)
+// close every bin that ends at or before time_ns, labelled by end time
+static void series_advance(struct bin_series *b, unsigned long time_ns)
 {
-    g_head = g_tail = NULL;
+    unsigned long index = time_ns / b->res_ns;
+    unsigned long i;
+
+    if(index<=b->index) return;
+
+    trace_writer_add(&b->out, (b->index+1)*b->res_ns, b->bytes);
+    stats_add(&b->stats, b->bytes);
+    for(i=b->index+1; i<index; ++i) {
+        trace_writer_add(&b->out, (i+1)*b->res_ns, 0);
+    }
+    stats_add_n(&b->stats, 0, index - b->index - 1);
+    fflush(b->logf);
+
+    b->index = index;
+    b->bytes = 0;
 }
 
-static int add_sample_to_log(unsigned long time_ms, unsigned long bytes)
+static void add_sample_to_log(unsigned long time_ns, unsigned long bytes)
 {
-    struct log_sample *newsample = malloc(sizeof(struct log_sample ));
-    if(NULL==newsample) return -1;
+    int i;
+
+    for(i=0; i<g_series_count; ++i) {
+        series_advance(&g_series[i], time_ns);
+        g_series[i].bytes += bytes;
+    }
+    g_sample_count++;
+}
 
-    newsample->time_ms = time_ms;
-    newsample->bytes = bytes;
-    newsample->prev = g_tail;
-    newsample->next = NULL;
+// keep logs current while no data comes in
+static void advance_sample_log(unsigned long time_ns)
+{
+    int i;
 
-    if(NULL==g_head || NULL==g_tail) { // empty list
-        g_head = g_tail = newsample;
+    for(i=0; i<g_series_count; ++i) {
+        series_advance(&g_series[i], time_ns);
     }
-    else {
-        g_tail->next = newsample;
-        g_tail = newsample;
+}
+
+// the bin still open at the end is partial and left out
+static void analyze_sample_and_report(void)
+{
+    int i;
+
+    fprintf(stderr, "%s Total report %ld samples\n", MODULE, g_sample_count);
+    for(i=0; i<g_series_count; ++i) {
+        const struct stream_stats *st = &g_series[i].stats;
+
+        fprintf(stderr, "%s Report granularity: %ld milli seconds\n", MODULE,
+                g_series[i].res_ns/1000000);
+        if(st->count) {
+            fprintf(stderr, "%s Standard deviation(count=%ld , mean=%.0f): %.0f\n", 
+                    MODULE, st->count, st->mean, stats_stddev(st));
+            fprintf(stderr, "%s Bin min %ld, max %ld bytes\n", MODULE, st->min, st->max);
+        }
+        trace_writer_close(&g_series[i].out);
+        fclose(g_series[i].logf);
     }
+}
+
+// ==========================================================================
+// Validation pipeline: the reader reads into slots of a ring and stamps
+// each read; validator threads check slots in parallel, and the reader
+// retires them in stream order. The payload is a pure function of stream
+// offset, so any slot can be checked on its own.
+//
+// Slots are handed out by sequence number. The reader publishes slot n
+// by moving g_published past n, a validator claims it by moving g_claimed
+// with compare-and-swap, and marks it done. Neither side takes a lock.
+//
+// The stream "phase" is the counter value at stream offset 0, so byte n
+// should be (phase + n) & 0xFF. Each validator finds the phase its slot
+// starts and ends with, and the errors inside the slot. On a mismatch it
+// resyncs on the next SYNC_BYTES bytes that follow the counter: the same
+// phase again means bit errors, a new phase means bytes were dropped or
+// duplicated. The reader links the phases of consecutive slots. Runs are
+// only known modulo 256, the period of the counter.
+
+#define PIPE_SLOTS_MAX 256
+#define PIPE_MEMORY (64*1024*1024)
+#define SYNC_BYTES 16
+#define SLOT_EVENTS 8 // errors kept in detail per slot, the rest are counted
+#define PRINT_EVENTS_MAX 100
+
+enum loss_type {
+    e_Loss_BitError,
+    e_Loss_Dropped,
+    e_Loss_Duplicated,
+    e_Loss_TypeMax,
+};
+static const char *loss_type_names[e_Loss_TypeMax] = {
+    "bit error", "dropped", "duplicated",
+};
+
+struct loss_event {
+    enum loss_type type;
+    unsigned long offset; // stream offset
+    unsigned long bytes;
+    unsigned long bits; // flipped bits, bit errors only
+};
+
+struct loss_stats {
+    unsigned long count[e_Loss_TypeMax];
+    unsigned long bytes[e_Loss_TypeMax];
+    unsigned long bits;
+};
 
-    return 0;
+// first few errors in detail, and totals of all
+struct loss_list {
+    int event_count;
+    struct loss_event events[SLOT_EVENTS];
+    struct loss_stats stats;
+};
+
+struct pipe_slot {
+    unsigned char *buf;
+    size_t nbyte;
+    unsigned long offset; // stream offset of buf[0]
+    long time_ns; // read time since start
+    atomic_int done;
+
+    // filled by validator
+    int start_phase; // -1 if no byte in sync
+    int end_phase;
+    size_t lead_bytes; // bytes before first sync
+    struct loss_list loss;
+};
+
+static struct pipe_slot *g_slots;
+static unsigned long g_slot_count;
+static atomic_ulong g_published; // slots handed to validators
+static atomic_ulong g_claimed; // slots taken by validators
+static unsigned long g_retired; // slots checked and free again, reader only
+static atomic_int g_pipe_stop;
+static pthread_t *g_validator_threads;
+static int g_phase = -1; // stream phase after last retired slot
+static struct loss_stats g_loss;
+static unsigned long g_events_printed;
+
+static void pipe_idle(void)
+{
+    struct timespec ts = { 0, 50*1000 };
+    nanosleep(&ts, NULL);
 }
 
-static int analyze_sample_and_report(FILE* logf)
+static void loss_add_event(struct loss_list *l, enum loss_type type,
+                    unsigned long offset, unsigned long bytes, unsigned long bits)
 {
-    unsigned long count = 0;
-    unsigned long bytes = 0;
-    unsigned long time_unit = 1;
-    struct log_sample *head = g_head;
-    
-    struct sample_t {
-        unsigned long time;
-        unsigned long bytes;
-        struct sample_t *next;
-    };
-    struct sample_t *shead=NULL, *stail=NULL, *shead_temp;
-    unsigned long sample_count = 0;
-    unsigned long sample_sum = 0;
-    unsigned long sample_mean;
-    unsigned long sample_square_diff=0;
-    unsigned long standard_deviation=0;
-
-    fprintf(stderr, "%s Report granularity: %d milli seconds\n", MODULE, g_granularity); 
-
-    while(head) {
-        //fprintf(logf, "%ld %ld\n", head->time_ms, head->bytes);
-        //fflush(logf);
-        
-        bytes += head->bytes;
-        count++;
-
-        if(time_unit*g_granularity <= head->time_ms) {
-            struct sample_t *newsample = malloc(sizeof(struct sample_t));
-            
-            fprintf(logf, "%ld %ld\n", time_unit*g_granularity, bytes);
-            fflush(logf);
-
-            newsample->time = time_unit*g_granularity;
-            newsample->bytes = bytes;
-            newsample->next = NULL;
-
-            if(NULL==shead || NULL==stail) { // empty list
-                shead = stail = newsample;
-            }
-            else {
-                stail->next = newsample;
-                stail = newsample;
-            }
+    if(l->event_count<SLOT_EVENTS) {
+        struct loss_event *e = &l->events[l->event_count++];
+        e->type = type;
+        e->offset = offset;
+        e->bytes = bytes;
+        e->bits = bits;
+    }
+    l->stats.count[type]++;
+    l->stats.bytes[type] += bytes;
+    l->stats.bits += bits;
+}
 
-            bytes = 0;
-            time_unit++;
+// compare buf[from~to) with phase, record wrong bytes as one bit error run
+static void slot_check_run(const struct pipe_slot *s, struct loss_list *l,
+                    size_t from, size_t to, int phase)
+{
+    unsigned long bytes = 0, bits = 0;
+    size_t i;
+
+    for(i=from; i<to; ++i) {
+        unsigned char diff = s->buf[i] ^ ((phase + s->offset + i) & 0xFF);
+        if(diff) {
+            bytes++;
+            bits += __builtin_popcount(diff);
         }
+    }
+    if(bytes) loss_add_event(l, e_Loss_BitError, s->offset+from, bytes, bits);
+}
+
+// a phase change from old to new at offset: the counter jumped ahead
+// when bytes were dropped, and back when bytes were repeated
+static void loss_phase_event(struct loss_list *l, unsigned long offset, int old, int new)
+{
+    int d = (new - old) & 0xFF;
 
-        head = head->next;
+    if(d<128) loss_add_event(l, e_Loss_Dropped, offset, d, 0);
+    else loss_add_event(l, e_Loss_Duplicated, offset, 256-d, 0);
+}
+
+static void validate_slot(struct pipe_slot *s)
+{
+    const unsigned char *buf = s->buf;
+    size_t n = s->nbyte, i;
+    long j;
+    int phase;
+
+    memset(&s->loss, 0, sizeof(s->loss));
+
+    j = validate_find_sync(buf, n, 0, SYNC_BYTES);
+    if(j<0) {
+        // nothing to lock on, the reader checks it against the stream
+        s->start_phase = s->end_phase = -1;
+        s->lead_bytes = n;
+        goto out;
     }
+    s->lead_bytes = j;
+    phase = (buf[j] - s->offset - j) & 0xFF;
+    s->start_phase = phase;
 
-    fprintf(stderr, "%s Total report %ld samples\n", MODULE, count);
+    for(i=j; i<n; ) {
+        long r = validate_block(buf+i, n-i, (phase + s->offset + i) & 0xFF);
+        int new_phase;
 
-    // calculate standard deviation of samples
-    
-    // work out the mean
-    shead_temp = shead;
-    while(shead_temp) {
-        sample_count++; 
-        sample_sum += shead_temp->bytes; 
+        if(r<0) break; // rest is fine, the fast path
+
+        i += r;
+        j = validate_find_sync(buf, n, i, SYNC_BYTES);
+        slot_check_run(s, &s->loss, i, j<0 ? n : j, phase);
+        if(j<0) break;
+
+        new_phase = (buf[j] - s->offset - j) & 0xFF;
+        if(new_phase!=phase) {
+            loss_phase_event(&s->loss, s->offset+j, phase, new_phase);
+        }
+        phase = new_phase;
+        i = j;
+    }
+    s->end_phase = phase;
+
+out:
+    atomic_store_explicit(&s->done, 1, memory_order_release);
+}
+
+static void *validator_thread_routine(void *data)
+{
+    while(!atomic_load(&g_pipe_stop)) {
+        unsigned long n = atomic_load(&g_claimed);
+
+        if(n >= atomic_load_explicit(&g_published, memory_order_acquire)) {
+            pipe_idle();
+            continue;
+        }
+        if(atomic_compare_exchange_weak(&g_claimed, &n, n+1)) {
+            validate_slot(&g_slots[n % g_slot_count]);
+        }
+    }
+    return NULL;
+}
 
-        shead_temp = shead_temp->next;
+static void pipeline_init(void)
+{
+    unsigned long i;
+
+    if(g_validators<0) {
+        g_validators = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+        if(g_validators<1) g_validators = 1;
     }
-    sample_mean = sample_sum / sample_count;
-
-    // work out the standard deviation
-    shead_temp = shead;
-    while(shead_temp) {
-        long diff;
-        unsigned long old_sqd = sample_square_diff;
-
-        diff = (long)shead_temp->bytes - (long)sample_mean; // diff to the mean
-        sample_square_diff += ((diff * diff)/sample_count); // squared difference
-        // divide by sample count here to avoid overlow long integer
-        if(sample_square_diff < old_sqd) {
-            fprintf(stderr, "%s long overflow!\n", MODULE);
+
+    g_slot_count = PIPE_MEMORY / g_buffer_size;
+    if(g_slot_count>PIPE_SLOTS_MAX) g_slot_count = PIPE_SLOTS_MAX;
+    if(g_slot_count<4) g_slot_count = 4;
+
+    g_slots = calloc(g_slot_count, sizeof(struct pipe_slot));
+    if(!g_slots) {
+        fprintf(stderr, "%s cannot allocate %ld slots\n", MODULE, g_slot_count);
+        exit(1);
+    }
+    for(i=0; i<g_slot_count; ++i) {
+        g_slots[i].buf = malloc(g_buffer_size);
+        if(!g_slots[i].buf) {
+            fprintf(stderr, "cannot allocate buffer of %d bytes\n", g_buffer_size);
             exit(1);
         }
+    }
 
-        shead_temp = shead_temp->next;
+    g_validator_threads = calloc(g_validators+1, sizeof(pthread_t));
+    for(i=0; i<g_validators; ++i) {
+        int ret = pthread_create(&g_validator_threads[i], NULL, validator_thread_routine, NULL);
+        if(ret!=0) {
+            fprintf(stderr, "%s cannot create thread: %s\n", MODULE, strerror(ret));
+            exit(1);
+        }
+    }
+    fprintf(stderr, "%s Validate with %s, %d threads, %ld slots\n", MODULE,
+            validate_kernel_names[validate_kernel()], g_validators, g_slot_count);
+}
+
+static void loss_event_report(const struct pipe_slot *s, const struct loss_event *e)
+{
+    if(!g_keep_going) {
+        fprintf(stderr, "%s byte %ld error: %s %ld bytes\n", MODULE,
+                e->offset, loss_type_names[e->type], e->bytes);
+        exit(1);
     }
-    standard_deviation = sqrt(sample_square_diff); 
-    fprintf(stderr, "%s Standard deviation(count=%ld , mean=%ld): %ld\n", 
-            MODULE,
-            sample_count, sample_mean, standard_deviation);
 
-    return 0;
+    if(g_events_printed++ >= PRINT_EVENTS_MAX) return;
+    fprintf(stderr, "%s @%ld ms byte %ld: %s %ld bytes", MODULE,
+            s->time_ns/1000000, e->offset, loss_type_names[e->type], e->bytes);
+    if(e_Loss_BitError==e->type) fprintf(stderr, ", %ld bits", e->bits);
+    fprintf(stderr, "%s\n", g_events_printed==PRINT_EVENTS_MAX ?
+            " (further errors are only counted)" : "");
 }
 
-static unsigned long get_time_interval_in_ms(const struct timeval *pt1,
-                        const struct timeval *pt2)
+static void loss_add(struct loss_stats *to, const struct loss_stats *from)
 {
-    unsigned long diff_in_ms;
+    int i;
 
-    diff_in_ms = (pt2->tv_sec - pt1->tv_sec)*1000;
-    
-    if(pt2->tv_usec < pt1->tv_usec) {
-        diff_in_ms -= 1000; // borrow 1 second to pt2
-        diff_in_ms += (pt2->tv_usec+1000000 - pt1->tv_usec)/1000;
+    for(i=0; i<e_Loss_TypeMax; ++i) {
+        to->count[i] += from->count[i];
+        to->bytes[i] += from->bytes[i];
+    }
+    to->bits += from->bits;
+}
+
+static void loss_list_report(const struct pipe_slot *s, const struct loss_list *l)
+{
+    int i;
+
+    for(i=0; i<l->event_count; ++i) {
+        loss_event_report(s, &l->events[i]);
     }
-    else {
-        diff_in_ms += (pt2->tv_usec-pt1->tv_usec)/1000;
+    loss_add(&g_loss, &l->stats);
+}
+
+// link the slot to the stream before it: check bytes before its first
+// sync against the stream phase, and look for a phase change between
+// slots. Then account for the errors found inside the slot.
+static void retire_slot(struct pipe_slot *s)
+{
+    int phase = g_phase>=0 ? g_phase : s->start_phase;
+    struct loss_list link;
+
+    memset(&link, 0, sizeof(link));
+    if(s->lead_bytes && phase>=0) {
+        slot_check_run(s, &link, 0, s->lead_bytes, phase);
     }
+    if(g_phase>=0 && s->start_phase>=0 && s->start_phase!=g_phase) {
+        loss_phase_event(&link, s->offset+s->lead_bytes, g_phase, s->start_phase);
+    }
+    if(s->end_phase>=0) g_phase = s->end_phase;
 
-    return diff_in_ms;
+    loss_list_report(s, &link);
+    loss_list_report(s, &s->loss);
 }
 
+static void loss_report(void)
+{
+    int i;
+
+    if(!g_keep_going) return;
+
+    fprintf(stderr, "%s Errors:", MODULE);
+    for(i=0; i<e_Loss_TypeMax; ++i) {
+        fprintf(stderr, "%s %s %ld runs %ld bytes", i ? "," : "",
+                loss_type_names[i], g_loss.count[i], g_loss.bytes[i]);
+    }
+    fprintf(stderr, ", %ld bits flipped\n", g_loss.bits);
+}
+
+// check finished slots in stream order and free them.
+// with wait, keep going until every published slot is retired.
+static void pipeline_retire(int wait)
+{
+    unsigned long published = atomic_load(&g_published);
+
+    while(g_retired < published) {
+        struct pipe_slot *s = &g_slots[g_retired % g_slot_count];
+
+        if(!atomic_load_explicit(&s->done, memory_order_acquire)) {
+            if(!wait) break;
+            pipe_idle();
+            continue;
+        }
+
+        retire_slot(s);
+        atomic_store(&s->done, 0);
+        g_retired++;
+    }
+}
+
+// a slot to read into, waits for validators when all are in use
+static struct pipe_slot *pipeline_get_slot(void)
+{
+    unsigned long published = atomic_load(&g_published);
+
+    pipeline_retire(0);
+    while(published - g_retired >= g_slot_count) {
+        pipe_idle();
+        pipeline_retire(0);
+    }
+    return &g_slots[published % g_slot_count];
+}
+
+// hand a filled slot to validators, or check it here without threads
+static void pipeline_publish(struct pipe_slot *s, size_t nbyte, unsigned long offset,
+                    long time_ns)
+{
+    s->nbyte = nbyte;
+    s->offset = offset;
+    s->time_ns = time_ns;
+
+    if(0==g_validators) {
+        validate_slot(s);
+    }
+    atomic_fetch_add_explicit(&g_published, 1, memory_order_release);
+}
+
+static void pipeline_finish(void)
+{
+    int i;
+
+    pipeline_retire(1);
+    atomic_store(&g_pipe_stop, 1);
+    for(i=0; i<g_validators; ++i) {
+        pthread_join(g_validator_threads[i], NULL);
+    }
+}
+
+// End of validation pipeline
+// ==========================================================================
+
 static void signal_handler(int signo)
 {
     g_to_quit = 1;
@@ -172,27 +566,34 @@ static void signal_handler(int signo)
 
 int main(int argc, char **argv)
 {
-	unsigned char *buf;
     int inf, outf; //TODO: remove outf
-    FILE *logf = NULL;
+    const char *log_path = NULL;
+    int resolutions[MAX_RESOLUTIONS] = { 100 }, resolution_count = 1;
     unsigned long total_size = 0;
-    struct timeval t2, t_start;
-    int payload_counter = -1;
+    long t2, t_start;
     //fd_set rfd;
 
     while(1) {
         int c;
 
-        if( -1 == (c = getopt(argc, argv, "?hg:t:s:")) ) break;
+        if( -1 == (c = getopt(argc, argv, "?hg:t:s:b:j:k")) ) break;
 
         switch(c) {
         case '?':
         case 'h':
-            fprintf(stderr, "%s [-g granularity] [-t run-time] -s file\n", argv[0]);
-            fprintf(stderr, "-g set granularity of the report in milli seconds\n");
+            fprintf(stderr, "%s [-g granularity[,granularity]...] [-t run-time] [-b buffer_size] [-j threads] [-k] -s file\n", argv[0]);
+            fprintf(stderr, "-g set granularity of the report in milli seconds, default 100.\n");
+            fprintf(stderr, "   Up to %d, comma separated, are binned at once. The first\n", MAX_RESOLUTIONS);
+            fprintf(stderr, "   goes to the -s file, the others to file.<granularity>ms\n");
             fprintf(stderr, "-t set maximum time for capture and analyze. Default is forever\n");
+            fprintf(stderr, "-b read size, default %d bytes\n", g_buffer_size);
+            fprintf(stderr, "-j number of validation threads, 0 validates in the reader.\n");
+            fprintf(stderr, "   Default is one less than CPUs\n");
+            fprintf(stderr, "-k keep going on payload errors, count bit errors, dropped and\n");
+            fprintf(stderr, "   duplicated bytes and report them at the end\n");
             fprintf(stderr, "-s generate time and data size to log file\n");
-            fprintf(stderr, "   format is \"time-in-millisecond bytes\" perline\n");
+            fprintf(stderr, "   format is \"time-in-millisecond bytes\" perline,\n");
+            fprintf(stderr, "   or a binary trace if file ends with .btr\n");
             fprintf(stderr, "\nThis tool calculates bytes flow from stdin\n\n");
             exit(1);
             break;
@@ -202,24 +603,40 @@ int main(int argc, char **argv)
             break;
 
         case 'g':
-            g_granularity = atoi(optarg);
-            break;
-
-        case 's':
             {
-                logf = fopen(optarg, "w+");
-                if(NULL==logf) {
-                    fprintf(stderr, "%s cannot open '%s' for writing: %s\n",
-                            MODULE, optarg, strerror(errno));
-                    exit(1);
+                char *tok, *save = NULL;
+
+                resolution_count = 0;
+                for(tok=strtok_r(optarg, ",", &save); tok; tok=strtok_r(NULL, ",", &save)) {
+                    if(resolution_count>=MAX_RESOLUTIONS || atoi(tok)<=0) {
+                        fprintf(stderr, "%s bad granularity '%s'\n", MODULE, tok);
+                        exit(1);
+                    }
+                    resolutions[resolution_count++] = atoi(tok);
                 }
                 break;
             }
 
+        case 'b':
+            g_buffer_size = atoi(optarg);
+            break;
+
+        case 'j':
+            g_validators = atoi(optarg);
+            break;
+
+        case 'k':
+            g_keep_going = 1;
+            break;
+
+        case 's':
+            log_path = optarg;
+            break;
+
         }
     }
 
-    if(NULL==logf) {
+    if(NULL==log_path || 0==resolution_count) {
         fprintf(stderr, "%s Please specify path to log file via \"-s\" option.\n", MODULE);
         exit(1);
     }
@@ -239,24 +656,19 @@ int main(int argc, char **argv)
         exit(1);
     }
 
-    buf = malloc(g_buffer_size);
-    if(!buf) {
-        fprintf(stderr, "cannot allocate buffer of %d bytes\n", g_buffer_size);
-        exit(1);
-    }
-
     signal(SIGINT, signal_handler);
 
-    fprintf(logf, "time-in-ms bytes\n");
-
-    gettimeofday(&t_start, NULL);
-    //gettimeofday(&t1, NULL);
+    init_sample_log(log_path, resolutions, resolution_count);
 
-    init_sample_log();
+    mono_clock_init();
+    validate_init();
+    pipeline_init();
+    t_start = mono_now_ns();
 
     // calculate the byte count every specified milli-second
 	while(!g_to_quit) {
         ssize_t sizer;
+        struct pipe_slot *slot = pipeline_get_slot();
        // unsigned long time_diff_millisec;
         fd_set rfd;
         struct timeval timeout;
@@ -269,47 +681,30 @@ int main(int argc, char **argv)
 
         ret = select(inf+1, &rfd, NULL, NULL, &timeout);
         if(0==ret || !FD_ISSET(inf, &rfd)) {
-            sizer = 0;
-        }
-        else {
-            sizer = read(inf, buf, g_buffer_size);
+            // nothing in 100 milli seconds
+            advance_sample_log(mono_now_ns() - t_start);
+            continue;
         }
 
+        sizer = read(inf, slot->buf, g_buffer_size);
         if(sizer<0) {
             fprintf(stderr, "%s read error: %s\n", MODULE, strerror(errno));
             break;
         }
         else if(sizer==0) {
-            continue;
+            break; // EOF
         }
 
-        // validate data integrity
-
-        int i;
-        if(-1==payload_counter) {
-            i = 1;
-            payload_counter = buf[0];
-        }
-        else {
-            i = 0;
-        }
-        for(i; i<sizer; ++i) {
-            if( ((payload_counter+1)&0xFF) != buf[i]) {
-                fprintf(stderr, "%s byte %ld error (%d/%d) \n", MODULE,
-                        total_size+i, payload_counter, buf[i]);
-                exit(1);
-            }
-            payload_counter = (payload_counter+1) & 0xFF;
-        }
+        t2 = mono_now_ns();
 
-        gettimeofday(&t2, NULL);
+        // validate data integrity, off this thread
+        pipeline_publish(slot, sizer, total_size, t2 - t_start);
 
-        unsigned long time_diff_from_start = get_time_interval_in_ms(&t_start, &t2);
-        add_sample_to_log(time_diff_from_start, sizer);
+        unsigned long time_diff_from_start = mono_interval_in_ms(t_start, t2);
+        add_sample_to_log(t2 - t_start, sizer);
 
         total_size += (unsigned long)sizer;
 
-        //time_diff_millisec = get_time_interval_in_ms(&t1, &t2);
 
         //fprintf(stderr, "dbg: %ld %ld\n", time_diff_from_start, sizer);
 
@@ -317,12 +712,13 @@ int main(int argc, char **argv)
 
 	} // end of while loop
 
+    pipeline_finish();
 	fprintf(stderr, "%s Total %ld bytes read\n", MODULE, total_size);
+    loss_report();
     close(inf);
     close(outf);
 
-    analyze_sample_and_report(logf);
-    fclose(logf);
+    analyze_sample_and_report();
 
 	return 0;
 }
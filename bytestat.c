@@ -0,0 +1,281 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <getopt.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "trace.h"
+
+#define MODULE "[bytestat]"
+
+// Compare directories of "time-in-ms bytes" logs. Every log found under the
+// given paths is mmapped and parsed by a pool of worker threads, each
+// claiming the next file from a shared counter. Statistics are computed on
+// the rate of each logged interval, in bytes/sec.
+
+#define NUM_PERCENTILES 3
+static const double g_percentiles[NUM_PERCENTILES] = { 50, 90, 99 };
+
+struct log_stats {
+    char *path;
+    int error; // errno of load, 0 on success
+    unsigned long points;
+    unsigned long bytes;
+    double duration; // sec
+    double mean; // bytes/sec over the whole log
+    double stddev; // of interval rates
+    double percentile[NUM_PERCENTILES];
+    double peak;
+};
+
+static struct log_stats *g_logs = NULL;
+static unsigned long g_log_count = 0;
+static unsigned long g_log_cap = 0;
+static atomic_ulong g_next_log;
+static const char *g_suffix = NULL; // NULL for text logs and binary traces
+
+// move the k-th smallest of v[0..n) to v[k], smaller ones before it
+static void select_kth(double *v, unsigned long n, unsigned long k)
+{
+    unsigned long lo = 0, hi = n-1;
+
+    while(lo<hi) {
+        double pivot = v[lo + (hi-lo)/2], tmp;
+        unsigned long i = lo, j = hi;
+
+        while(i<=j) {
+            while(v[i]<pivot) ++i;
+            while(v[j]>pivot) --j;
+            if(i<=j) {
+                tmp = v[i]; v[i] = v[j]; v[j] = tmp;
+                ++i;
+                if(0==j) break;
+                --j;
+            }
+        }
+        if(k<=j) hi = j;
+        else if(k>=i) lo = i;
+        else break;
+    }
+}
+
+static int cmp_log_path(const void *a, const void *b)
+{
+    return strcmp(((const struct log_stats *)a)->path, ((const struct log_stats *)b)->path);
+}
+
+static int add_log(const char *path)
+{
+    if(g_log_count==g_log_cap) {
+        unsigned long cap = g_log_cap ? g_log_cap*2 : 256;
+        struct log_stats *logs = realloc(g_logs, cap*sizeof(*logs));
+
+        if(NULL==logs) return -1;
+        g_logs = logs;
+        g_log_cap = cap;
+    }
+    memset(&g_logs[g_log_count], 0, sizeof(g_logs[0]));
+    g_logs[g_log_count].path = strdup(path);
+    if(NULL==g_logs[g_log_count].path) return -1;
+    g_log_count++;
+    return 0;
+}
+
+static int walk_entry(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    size_t len = strlen(path);
+
+    if(FTW_F!=type) return 0;
+    if(g_suffix) {
+        size_t slen = strlen(g_suffix);
+        if(len<slen || strcmp(path+len-slen, g_suffix)) return 0;
+    }
+    else if(len<4 || (strcmp(path+len-4, ".txt") && strcmp(path+len-4, ".btr"))) return 0;
+    return add_log(path)<0 ? -1 : 0;
+}
+
+static void analyze_log(struct log_stats *s)
+{
+    struct trace t;
+    double *rates, sum = 0, sum2 = 0;
+    unsigned long k, n = 0, pending = 0, prev_rank = 0;
+    long prev_ns = 0;
+    int i;
+
+    if(trace_load(&t, s->path)<0) {
+        s->error = errno;
+        return;
+    }
+
+    s->points = t.count;
+    s->bytes = trace_total_bytes(&t);
+    if(0==t.count) {
+        trace_free(&t);
+        return;
+    }
+    s->duration = t.time_ns[t.count-1]/1e9;
+    s->mean = s->duration>0 ? s->bytes/s->duration : 0;
+
+    // rate of each interval, points logged at the same millisecond are
+    // folded into the next interval
+    rates = malloc(t.count*sizeof(double));
+    if(NULL==rates) {
+        s->error = ENOMEM;
+        trace_free(&t);
+        return;
+    }
+    for(k=0; k<t.count; ++k) {
+        pending += t.bytes[k];
+        if(t.time_ns[k]<=prev_ns) continue;
+        rates[n] = pending/((t.time_ns[k]-prev_ns)/1e9);
+        sum += rates[n];
+        sum2 += rates[n]*rates[n];
+        if(rates[n]>s->peak) s->peak = rates[n];
+        n++;
+        pending = 0;
+        prev_ns = t.time_ns[k];
+    }
+    trace_free(&t);
+
+    if(n) {
+        double m = sum/n;
+
+        s->stddev = sum2/n>m*m ? sqrt(sum2/n - m*m) : 0;
+        // nearest rank percentiles, highest first so each selection only
+        // needs to search below the previous one
+        for(i=NUM_PERCENTILES-1; i>=0; --i) {
+            unsigned long rank = (unsigned long)ceil(g_percentiles[i]/100*n);
+            unsigned long limit = i<NUM_PERCENTILES-1 ? prev_rank+1 : n;
+
+            rank = rank ? rank-1 : 0;
+            select_kth(rates, limit, rank);
+            s->percentile[i] = rates[rank];
+            prev_rank = rank;
+        }
+    }
+    free(rates);
+}
+
+static void *worker_thread(void *arg)
+{
+    unsigned long i;
+
+    while( (i=atomic_fetch_add(&g_next_log, 1)) < g_log_count ) {
+        analyze_log(&g_logs[i]);
+    }
+    return NULL;
+}
+
+static void print_table(void)
+{
+    unsigned long i;
+    int width = 4, j;
+
+    for(i=0; i<g_log_count; ++i) {
+        int len = strlen(g_logs[i].path);
+        if(len>width) width = len;
+    }
+
+    printf("%-*s %8s %8s %12s %10s %10s", width, "log", "points", "sec", "bytes", "mean", "stddev");
+    for(j=0; j<NUM_PERCENTILES; ++j) {
+        char label[16];
+
+        snprintf(label, sizeof(label), "p%g", g_percentiles[j]);
+        printf(" %10s", label);
+    }
+    printf(" %10s %6s\n", "peak", "pk/avg");
+
+    for(i=0; i<g_log_count; ++i) {
+        struct log_stats *s = &g_logs[i];
+
+        if(s->error) {
+            printf("%-*s %s\n", width, s->path, strerror(s->error));
+            continue;
+        }
+        printf("%-*s %8lu %8.1f %12lu %10.0f %10.0f", width, s->path, s->points,
+                s->duration, s->bytes, s->mean, s->stddev);
+        for(j=0; j<NUM_PERCENTILES; ++j) printf(" %10.0f", s->percentile[j]);
+        printf(" %10.0f %6.2f\n", s->peak, s->mean>0 ? s->peak/s->mean : 0);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    pthread_t *threads;
+    int jobs = 0, i;
+
+    while(1) {
+        int c;
+
+        if( -1 == (c = getopt(argc, argv, "?hj:x:")) ) break;
+
+        switch(c) {
+        case '?':
+        case 'h':
+            fprintf(stderr, "%s [-j threads] [-x suffix] path...\n", argv[0]);
+            fprintf(stderr, "-j number of parser threads, default is number of CPUs\n");
+            fprintf(stderr, "-x only analyze files ending with suffix, default .txt and .btr\n");
+            fprintf(stderr, "\nThis tool prints a comparison table of \"time-in-millisecond bytes\" logs\n");
+            fprintf(stderr, "found under the given files and directories. Rates are in bytes/sec.\n\n");
+            exit(1);
+            break;
+
+        case 'j':
+            jobs = atoi(optarg);
+            break;
+
+        case 'x':
+            g_suffix = optarg;
+            break;
+        }
+    }
+
+    if(optind>=argc) {
+        fprintf(stderr, "%s Please specify logs or directories to analyze.\n", MODULE);
+        exit(1);
+    }
+
+    for(i=optind; i<argc; ++i) {
+        if(nftw(argv[i], walk_entry, 32, FTW_PHYS)!=0) {
+            fprintf(stderr, "%s cannot walk '%s': %s\n", MODULE, argv[i], strerror(errno));
+            exit(1);
+        }
+    }
+    if(0==g_log_count) {
+        fprintf(stderr, "%s no logs ending with '%s' found\n", MODULE, g_suffix ? g_suffix : ".txt or .btr");
+        exit(1);
+    }
+
+    if(jobs<=0) jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    if(jobs>g_log_count) jobs = g_log_count;
+
+    threads = calloc(jobs, sizeof(pthread_t));
+    if(NULL==threads) {
+        fprintf(stderr, "%s cannot allocate %d threads\n", MODULE, jobs);
+        exit(1);
+    }
+    atomic_init(&g_next_log, 0);
+    for(i=0; i<jobs; ++i) {
+        if(0!=pthread_create(&threads[i], NULL, worker_thread, NULL)) {
+            fprintf(stderr, "%s cannot create thread: %s\n", MODULE, strerror(errno));
+            exit(1);
+        }
+    }
+    for(i=0; i<jobs; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    qsort(g_logs, g_log_count, sizeof(g_logs[0]), cmp_log_path);
+    print_table();
+
+    for(i=0; i<g_log_count; ++i) free(g_logs[i].path);
+    free(g_logs);
+    return 0;
+}
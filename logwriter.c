@@ -0,0 +1,115 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "logwriter.h"
+
+#define MODULE "[logwriter]"
+
+// write out everything queued, return number of records
+static unsigned long drain(struct log_writer *w)
+{
+    unsigned long tail = atomic_load_explicit(&w->tail, memory_order_relaxed);
+    unsigned long head = atomic_load_explicit(&w->head, memory_order_acquire);
+    unsigned long n = head - tail;
+
+    for(; tail!=head; ++tail) {
+        const struct log_record *r = &w->ring[tail & (w->size-1)];
+        trace_writer_add(&w->out, r->time_ns, r->bytes);
+    }
+    atomic_store_explicit(&w->tail, tail, memory_order_release);
+    w->written += n;
+    return n;
+}
+
+static void *writer_thread(void *arg)
+{
+    struct log_writer *w = arg;
+    struct timespec poll = { 0, LOG_WRITER_POLL_MS*1000000L };
+
+    while(!atomic_load(&w->quit)) {
+        // flush once the ring runs empty, so the file is never more than
+        // a poll period behind
+        if(0==drain(w)) {
+            fflush(w->f);
+            nanosleep(&poll, NULL);
+        }
+    }
+    drain(w);
+    return NULL;
+}
+
+int log_writer_open(struct log_writer *w, FILE *f, enum trace_format format,
+                        unsigned long records)
+{
+    memset(w, 0, sizeof(*w));
+
+    if(records & (records-1)) {
+        fprintf(stderr, "%s ring size %lu is not a power of 2\n", MODULE, records);
+        return -1;
+    }
+
+    w->f = f;
+    w->size = records;
+    w->ring = malloc(records*sizeof(struct log_record));
+    if(NULL==w->ring) {
+        fprintf(stderr, "%s cannot allocate ring of %lu records\n", MODULE, records);
+        return -1;
+    }
+    atomic_init(&w->head, 0);
+    atomic_init(&w->tail, 0);
+    atomic_init(&w->quit, 0);
+
+    // a large stdio buffer, the writer thread does few big writes
+    setvbuf(w->f, NULL, _IOFBF, 1024*1024);
+    if(trace_writer_open(&w->out, w->f, format)<0) {
+        fprintf(stderr, "%s cannot write log header: %s\n", MODULE, strerror(errno));
+        free(w->ring);
+        w->ring = NULL;
+        return -1;
+    }
+
+    if(0!=pthread_create(&w->thread, NULL, writer_thread, w)) {
+        fprintf(stderr, "%s cannot create writer thread: %s\n", MODULE, strerror(errno));
+        free(w->ring);
+        w->ring = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+int log_writer_push(struct log_writer *w, long time_ns, unsigned long bytes)
+{
+    unsigned long head = atomic_load_explicit(&w->head, memory_order_relaxed);
+    unsigned long tail = atomic_load_explicit(&w->tail, memory_order_acquire);
+    struct log_record *r;
+
+    if(head - tail >= w->size) {
+        w->dropped++;
+        return -1;
+    }
+
+    r = &w->ring[head & (w->size-1)];
+    r->time_ns = time_ns;
+    r->bytes = bytes;
+    atomic_store_explicit(&w->head, head+1, memory_order_release);
+    return 0;
+}
+
+void log_writer_close(struct log_writer *w)
+{
+    if(NULL==w->ring) return;
+
+    atomic_store(&w->quit, 1);
+    pthread_join(w->thread, NULL);
+    if(trace_writer_close(&w->out)<0) {
+        fprintf(stderr, "%s cannot finish log: %s\n", MODULE, strerror(errno));
+    }
+    fclose(w->f);
+    free(w->ring);
+    w->ring = NULL;
+}
@@ -0,0 +1,48 @@
+#ifndef __LOGWRITER_H__
+#define __LOGWRITER_H__
+
+#include <stdio.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "trace.h"
+
+// ==========================================================================
+// Asynchronous log writer: the data path pushes fixed size (time, bytes)
+// records into a single-producer/single-consumer ring, and a writer thread
+// formats them and does all file I/O. A push never blocks; when the ring
+// is full the record is dropped and counted.
+
+#define LOG_RING_RECORDS_DEFAULT (64*1024) // power of 2
+#define LOG_WRITER_POLL_MS 10
+
+struct log_record {
+    long time_ns; // since start of capture
+    unsigned long bytes;
+};
+
+struct log_writer {
+    FILE *f;
+    struct trace_writer out;
+
+    struct log_record *ring;
+    unsigned long size; // records, power of 2
+    atomic_ulong head; // records pushed, moved by producer
+    atomic_ulong tail; // records written, moved by writer thread
+    atomic_int quit;
+
+    unsigned long written;
+    unsigned long dropped; // producer only
+
+    pthread_t thread;
+};
+
+// start writer thread on f, which the writer owns from now on
+int log_writer_open(struct log_writer *w, FILE *f, enum trace_format format,
+                        unsigned long records);
+// producer side. return -1 and count a drop if the ring is full
+int log_writer_push(struct log_writer *w, long time_ns, unsigned long bytes);
+// write out what is queued, stop thread and close file
+void log_writer_close(struct log_writer *w);
+
+#endif //__LOGWRITER_H__
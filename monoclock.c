@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <time.h>
+
+#include "monoclock.h"
+
+#ifdef MONO_HAVE_TSC
+#include <cpuid.h>
+
+#define MONO_CALIBRATE_NS (20*1000000L)
+
+unsigned long g_mono_tsc_base;
+unsigned long g_mono_tsc_mult;
+long g_mono_ns_base;
+
+static long monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000000L + ts.tv_nsec;
+}
+
+// TSC ticks at a constant rate in all P/C states, CPUID 80000007H EDX[8]
+static int tsc_is_invariant(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if(!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) || eax<0x80000007) return 0;
+    if(!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx)) return 0;
+    return (edx>>8) & 1;
+}
+
+void mono_clock_init(void)
+{
+    struct timespec ts = { 0, MONO_CALIBRATE_NS };
+    unsigned long c0, c1;
+    long t0, t1;
+
+    if(g_mono_tsc_mult || !tsc_is_invariant()) return;
+
+    t0 = monotonic_ns();
+    c0 = __rdtsc();
+    nanosleep(&ts, NULL);
+    t1 = monotonic_ns();
+    c1 = __rdtsc();
+    if(c1<=c0 || t1<=t0) return;
+
+    g_mono_tsc_base = c1;
+    g_mono_ns_base = t1;
+    g_mono_tsc_mult = (unsigned long)(((unsigned __int128)(t1-t0) << MONO_TSC_SHIFT) / (c1-c0));
+}
+
+const char *mono_clock_source(void)
+{
+    return g_mono_tsc_mult ? "tsc" : "monotonic";
+}
+
+#else
+
+void mono_clock_init(void)
+{
+}
+
+const char *mono_clock_source(void)
+{
+    return "monotonic";
+}
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef __MONOCLOCK_H__
+#define __MONOCLOCK_H__
+
+#include <time.h>
+
+// ==========================================================================
+// Monotonic time stamps in nano seconds, cheap enough to take on every
+// read. CLOCK_MONOTONIC is never stepped by NTP, unlike gettimeofday().
+//
+// On x86-64 with an invariant TSC, mono_clock_init() calibrates the TSC
+// against CLOCK_MONOTONIC and mono_now_ns() is a rdtsc and a multiply.
+// Without mono_clock_init(), or without such a TSC, clock_gettime() is
+// used. Both start from the same CLOCK_MONOTONIC origin.
+
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#define MONO_HAVE_TSC 1
+#define MONO_TSC_SHIFT 32
+extern unsigned long g_mono_tsc_base;
+extern unsigned long g_mono_tsc_mult; // ns per tick << MONO_TSC_SHIFT, 0 if unused
+extern long g_mono_ns_base;
+#endif
+
+void mono_clock_init(void);
+const char *mono_clock_source(void);
+
+// CLOCK_MONOTONIC in nano seconds
+static inline long mono_now_ns(void)
+{
+    struct timespec ts;
+
+#ifdef MONO_HAVE_TSC
+    if(g_mono_tsc_mult) {
+        unsigned long ticks = __rdtsc() - g_mono_tsc_base;
+        return g_mono_ns_base +
+            (long)(((unsigned __int128)ticks * g_mono_tsc_mult) >> MONO_TSC_SHIFT);
+    }
+#endif
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000000L + ts.tv_nsec;
+}
+
+// milli seconds from t1 to t2, for the "time-in-ms" logs
+static inline unsigned long mono_interval_in_ms(long t1_ns, long t2_ns)
+{
+    return (t2_ns - t1_ns) / 1000000L;
+}
+
+#endif //__MONOCLOCK_H__
@@ -0,0 +1,122 @@
+#include <string.h>
+#include <math.h>
+
+#include "rate.h"
+
+const char *rate_window_names[e_Rate_WindowMax] = {
+    "100ms", "1s", "10s", "60s",
+};
+
+static const long rate_window_ns[e_Rate_WindowMax] = {
+    100*1000000L, 1000*1000000L, 10*1000*1000000L, 60*1000*1000000L,
+};
+
+void rate_est_init(struct rate_est *r, long now_ns)
+{
+    int w;
+
+    memset(r, 0, sizeof(*r));
+    r->start_ns = now_ns;
+    r->tick_start_ns = now_ns;
+    for(w=0; w<e_Rate_WindowMax; ++w) {
+        r->win[w].slot_ns = rate_window_ns[w] / RATE_SLOTS;
+        r->win[w].cur_start_ns = now_ns;
+        r->keep[w] = exp(-(double)RATE_TICK_NS / rate_window_ns[w]);
+    }
+}
+
+// move the window to the slot holding now, clearing slots passed
+static void window_advance(struct rate_window_state *s, long now_ns)
+{
+    long n = (now_ns - s->cur_start_ns) / s->slot_ns;
+
+    if(n<=0) return;
+    if(n>=RATE_SLOTS) {
+        memset(s->slots, 0, sizeof(s->slots));
+        s->sum = 0;
+    }
+    else {
+        long i;
+        for(i=0; i<n; ++i) {
+            s->cur = (s->cur+1) % RATE_SLOTS;
+            s->sum -= s->slots[s->cur];
+            s->slots[s->cur] = 0;
+        }
+    }
+    s->cur_start_ns += n * s->slot_ns;
+}
+
+// close EWMA ticks that ended before now
+static void ewma_advance(struct rate_est *r, long now_ns)
+{
+    long n = (now_ns - r->tick_start_ns) / RATE_TICK_NS;
+    double tick_rate;
+    int w;
+
+    if(n<=0) return;
+
+    // the tick with data, then n-1 idle ticks
+    tick_rate = (double)r->tick_bytes * 1000000000L / RATE_TICK_NS;
+    for(w=0; w<e_Rate_WindowMax; ++w) {
+        double idle = n>1 ? pow(r->keep[w], n-1) : 1;
+
+        r->ewma[w] = tick_rate + r->keep[w]*(r->ewma[w] - tick_rate);
+        r->weight[w] = 1 - r->keep[w]*(1 - r->weight[w]);
+        r->ewma[w] *= idle;
+        r->weight[w] = 1 - idle*(1 - r->weight[w]);
+    }
+    r->tick_bytes = 0;
+    r->tick_start_ns += n * RATE_TICK_NS;
+}
+
+void rate_est_update(struct rate_est *r, long now_ns)
+{
+    int w;
+
+    for(w=0; w<e_Rate_WindowMax; ++w) {
+        window_advance(&r->win[w], now_ns);
+    }
+    ewma_advance(r, now_ns);
+}
+
+void rate_est_add(struct rate_est *r, unsigned long nbyte, long now_ns)
+{
+    int w;
+
+    rate_est_update(r, now_ns);
+    for(w=0; w<e_Rate_WindowMax; ++w) {
+        r->win[w].slots[r->win[w].cur] += nbyte;
+        r->win[w].sum += nbyte;
+    }
+    r->tick_bytes += nbyte;
+    r->total_bytes += nbyte;
+}
+
+// bytes/sec over the last window, or since start if shorter
+unsigned long rate_est_window(struct rate_est *r, enum rate_window w, long now_ns)
+{
+    struct rate_window_state *s = &r->win[w];
+    long span;
+
+    rate_est_update(r, now_ns);
+    span = (RATE_SLOTS-1)*s->slot_ns + (now_ns - s->cur_start_ns);
+    if(span > now_ns - r->start_ns) span = now_ns - r->start_ns;
+    if(span<=0) return 0;
+
+    return (unsigned long)((double)s->sum * 1000000000L / span);
+}
+
+// bytes/sec, exponentially weighted with the window length as time constant
+unsigned long rate_est_ewma(struct rate_est *r, enum rate_window w, long now_ns)
+{
+    rate_est_update(r, now_ns);
+    if(r->weight[w]<=0) return 0;
+
+    return (unsigned long)(r->ewma[w] / r->weight[w]);
+}
+
+// whether the window has been running for its full length
+int rate_est_ready(const struct rate_est *r, enum rate_window w, long now_ns)
+{
+    return now_ns - r->start_ns >= rate_window_ns[w];
+}
@@ -0,0 +1,55 @@
+#ifndef __RATE_H__
+#define __RATE_H__
+
+// ==========================================================================
+// Byte rate estimator: sliding window and EWMA rates over several time
+// scales, updated in O(1) per read.
+//
+// Each window is a ring of RATE_SLOTS slots; only slots that fell out of
+// the window since last call are cleared. EWMAs are advanced every
+// RATE_TICK_NS with the bytes of that tick, idle ticks in closed form.
+// Until a window is full, rates are taken over the time seen so far, and
+// EWMAs are bias corrected, so estimates are usable from the first
+// hundred milliseconds. Time stamps are mono_now_ns() values.
+
+enum rate_window {
+    e_Rate_100ms,
+    e_Rate_1s,
+    e_Rate_10s,
+    e_Rate_60s,
+    e_Rate_WindowMax,
+};
+extern const char *rate_window_names[e_Rate_WindowMax];
+
+#define RATE_SLOTS 10
+#define RATE_TICK_NS (10*1000000L)
+
+struct rate_window_state {
+    long slot_ns;
+    unsigned long slots[RATE_SLOTS];
+    int cur; // slot counting bytes now
+    long cur_start_ns;
+    unsigned long sum; // bytes in all slots
+};
+
+struct rate_est {
+    long start_ns;
+    unsigned long total_bytes;
+    struct rate_window_state win[e_Rate_WindowMax];
+
+    // EWMA with time constant of each window, in bytes/sec
+    long tick_start_ns;
+    unsigned long tick_bytes;
+    double ewma[e_Rate_WindowMax];
+    double keep[e_Rate_WindowMax]; // 1-alpha per tick
+    double weight[e_Rate_WindowMax]; // 1-keep^ticks, for bias correction
+};
+
+void rate_est_init(struct rate_est *r, long now_ns);
+void rate_est_add(struct rate_est *r, unsigned long nbyte, long now_ns);
+void rate_est_update(struct rate_est *r, long now_ns);
+unsigned long rate_est_window(struct rate_est *r, enum rate_window w, long now_ns);
+unsigned long rate_est_ewma(struct rate_est *r, enum rate_window w, long now_ns);
+int rate_est_ready(const struct rate_est *r, enum rate_window w, long now_ns);
+
+#endif //__RATE_H__
@@ -0,0 +1,591 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <fcntl.h>
+
+#include "monoclock.h"
+#include "smooth.h"
+
+#define MODULE "[smooth]"
+
+// turn on/off debug message
+#if 1
+#define dbg_print(fmt, args...)  \
+        do {\
+            if(t->verbose) fprintf(stderr, "%s%s " fmt, MODULE, t->name, ##args);\
+        } while(0)
+#else
+    #define dbg_print(fmt, args...) do {} while(0)
+#endif
+#define err_print(fmt, args...)  \
+        do {\
+            fprintf(stderr, "%s%s " fmt, MODULE, t->name, ##args);\
+        } while(0)
+
+const char *smooth_full_policy_names[e_Full_PolicyMax] = {
+    "block", "oldest", "newest",
+};
+
+static int byte_ring_init(struct byte_ring *r, unsigned long size)
+{
+    if(0==size) return -1; // positions are taken modulo size
+    r->size = size;
+    r->buffer = malloc(r->size);
+    if(NULL==r->buffer) return -1;
+
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    atomic_init(&r->reading, RING_NOT_READING);
+    r->read_pos = 0;
+    return 0;
+}
+
+// number of bytes queued, safe to call from either thread
+static inline unsigned long byte_ring_level(struct byte_ring *r)
+{
+    unsigned long tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    unsigned long head = atomic_load_explicit(&r->head, memory_order_acquire);
+
+    return head - tail;
+}
+
+// producer side. bytes that can be pushed without touching data
+// the consumer may still be writing out
+static inline unsigned long byte_ring_space(struct byte_ring *r)
+{
+    unsigned long head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    unsigned long tail = atomic_load(&r->tail);
+    unsigned long reading = atomic_load(&r->reading);
+
+    if(reading < tail) tail = reading;
+    return r->size - (head-tail);
+}
+
+// producer side. return -1 if there is not enough room for nbyte.
+static int byte_ring_push(struct byte_ring *r, const void *buf, size_t nbyte)
+{
+    unsigned long head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    unsigned long pos = head % r->size;
+    unsigned long first;
+
+    if(byte_ring_space(r) < nbyte) return -1;
+
+    // copy may wrap around end of buffer
+    first = r->size - pos;
+    if(first > nbyte) first = nbyte;
+    memcpy(r->buffer+pos, buf, first);
+    memcpy(r->buffer, (const char *)buf+first, nbyte-first);
+
+    atomic_store_explicit(&r->head, head+nbyte, memory_order_release);
+    return 0;
+}
+
+// producer side. discard up to nbyte oldest bytes, return bytes dropped.
+// room is only gained once the consumer is done with what it is writing.
+static unsigned long byte_ring_drop_oldest(struct byte_ring *r, unsigned long nbyte)
+{
+    unsigned long head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    unsigned long tail = atomic_load(&r->tail);
+
+    do {
+        if(nbyte > head - tail) nbyte = head - tail;
+    } while(!atomic_compare_exchange_weak(&r->tail, &tail, tail+nbyte));
+
+    return nbyte;
+}
+
+// consumer side. describe up to max readable bytes at tail with iov,
+// which needs 2 entries when data wraps around end of buffer.
+// return number of iov entries used, 0 if ring is empty.
+// must be followed by byte_ring_consume(), even if nothing was written
+static int byte_ring_peekv(struct byte_ring *r, struct iovec iov[2], unsigned long max)
+{
+    unsigned long head, tail, pos, avail, first;
+
+    // publish where we read from, then make sure the producer did not
+    // drop it in the mean time
+    do {
+        tail = atomic_load(&r->tail);
+        atomic_store(&r->reading, tail);
+    } while(tail != atomic_load(&r->tail));
+    r->read_pos = tail;
+
+    head = atomic_load_explicit(&r->head, memory_order_acquire);
+    pos = tail % r->size;
+    avail = head - tail;
+
+    if(avail > max) avail = max;
+    if(0==avail) return 0;
+
+    first = r->size - pos;
+    if(first >= avail) {
+        iov[0].iov_base = r->buffer + pos;
+        iov[0].iov_len = avail;
+        return 1;
+    }
+
+    iov[0].iov_base = r->buffer + pos;
+    iov[0].iov_len = first;
+    iov[1].iov_base = r->buffer;
+    iov[1].iov_len = avail - first;
+    return 2;
+}
+
+// consumer side. release nbyte bytes described by byte_ring_peekv()
+static void byte_ring_consume(struct byte_ring *r, unsigned long nbyte)
+{
+    unsigned long end = r->read_pos + nbyte;
+    unsigned long tail = atomic_load(&r->tail);
+
+    // producer may have dropped past what we wrote already
+    while(tail < end && !atomic_compare_exchange_weak(&r->tail, &tail, end));
+
+    atomic_store(&r->reading, RING_NOT_READING);
+}
+
+static void push_to_queue(smooth_t *t, int fd, const void *buf, size_t nbyte)
+{
+    //fprintf(stderr, "%s + push to Q %ld\n", MODULE, nbyte);
+
+    if(byte_ring_push(&t->ring, buf, nbyte)<0) {
+        // queue is full
+        enum smooth_full_policy policy = t->full_policy;
+
+        if(0==t->full_count[policy]) {
+            err_print("queue full (%ld bytes), policy %s\n",
+                    t->ring.size, smooth_full_policy_names[policy]);
+        }
+
+        if(nbyte > t->ring.size) {
+            policy = e_Full_DropNewest; // never fits
+        }
+        else if(e_Full_Block==policy) {
+            struct timespec ts = { 0, 1000*1000 };
+
+            // a failed output never makes room again, drop instead
+            while(byte_ring_push(&t->ring, buf, nbyte)<0) {
+                if(t->write_errors) {
+                    policy = e_Full_DropNewest;
+                    break;
+                }
+                nanosleep(&ts, NULL);
+            }
+            if(e_Full_Block==policy) {
+                t->full_count[policy]++;
+                t->full_bytes[policy] += nbyte;
+            }
+        }
+        else if(e_Full_DropOldest==policy) {
+            t->full_count[policy]++;
+            t->full_bytes[policy] += byte_ring_drop_oldest(&t->ring,
+                    nbyte - byte_ring_space(&t->ring));
+            // pacing thread still holds part of the room, drop this instead
+            if(byte_ring_push(&t->ring, buf, nbyte)<0) {
+                policy = e_Full_DropNewest;
+            }
+        }
+
+        if(e_Full_DropNewest==policy) {
+            t->full_count[policy]++;
+            t->full_bytes[policy] += nbyte;
+            return;
+        }
+    }
+
+    t->total_in_bytes += nbyte;
+
+    //dbg_print("%s - push to Q %ld\n", nbyte);
+    
+    // incoming byte rate over the last second
+    long now = mono_now_ns();
+    rate_est_add(&t->incoming, nbyte, now);
+    if(e_Buffer_Normal==t->buffer_state) {
+        t->incoming_byte_rate = rate_est_window(&t->incoming, e_Rate_1s, now);
+    }
+}
+
+static void adjust_consumption_rate(smooth_t *t, long offset_bytes)
+{
+    // TODO: also adjusts interval
+    dbg_print("old rate=%ld, offset=%ld\n", t->write_byte_rate, offset_bytes);
+
+    long new_rate = (long)t->write_byte_rate +offset_bytes;
+    if(new_rate>0) {
+        t->write_byte_rate = new_rate;
+    }
+    else {
+        t->write_byte_rate = 0; // to a halt
+    }
+    t->write_interval_ms = t->initial_interval_ms;
+    t->write_chunk_bytes = t->write_byte_rate / (1000/t->write_interval_ms);    
+    dbg_print("new rate %ld, new chunk %ld\n", 
+            t->write_byte_rate, t->write_chunk_bytes);
+}
+
+// PI controller on buffer level, called every CTL_PERIOD_MS.
+//   err  = level - incoming_rate * target_delay
+//   rate = incoming_rate + kp * err + ki * integral(err)
+// Rate changes are limited to ctl_max_slew percent per second, and the
+// integral is clamped and frozen while the output is slew limited.
+static void control_consumption_rate(smooth_t *t, unsigned long level,
+                        long diff_ms, long average_out_rate)
+{
+    double dt = diff_ms / 1000.0;
+    double in_rate = t->incoming_byte_rate;
+    double target = in_rate * t->target_delay_ms / 1000.0;
+    double err = (double)level - target;
+    double old_integral = t->ctl_integral;
+    double limit, rate, max_delta, base;
+    long new_rate;
+
+    t->ctl_integral += err * dt;
+    // anti-windup: integral term alone may not exceed the incoming rate
+    if(t->ctl_ki > 0) {
+        limit = (in_rate > 0 ? in_rate : t->write_byte_rate) / t->ctl_ki;
+        if(t->ctl_integral > limit) t->ctl_integral = limit;
+        if(t->ctl_integral < -limit) t->ctl_integral = -limit;
+    }
+
+    rate = in_rate + t->ctl_kp * err + t->ctl_ki * t->ctl_integral;
+    if(rate < 0) rate = 0;
+
+    // bounded slew
+    base = t->write_byte_rate > in_rate ? t->write_byte_rate : in_rate;
+    if(base < 1024) base = 1024;
+    max_delta = base * t->ctl_max_slew / 100.0 * dt;
+    if(rate > t->write_byte_rate + max_delta) {
+        rate = t->write_byte_rate + max_delta;
+        t->ctl_integral = old_integral;
+    }
+    else if(rate < t->write_byte_rate - max_delta) {
+        rate = t->write_byte_rate - max_delta;
+        t->ctl_integral = old_integral;
+    }
+
+    new_rate = (long)rate;
+    dbg_print("ctl level=%ld target=%.0f err=%.0f integral=%.0f in=%.0f out=%ld rate %ld->%ld\n",
+            level, target, err, t->ctl_integral, in_rate, average_out_rate,
+            t->write_byte_rate, new_rate);
+
+    if(new_rate != (long)t->write_byte_rate) {
+        adjust_consumption_rate(t, new_rate - (long)t->write_byte_rate);
+    }
+}
+
+// get ready to pace, first tick is one interval from now
+static void smooth_pacing_begin(smooth_t *t)
+{
+    // a slow consumer must not stall the pacing clock. The fd may be a
+    // shared stdout, keep its flags so smooth_write_close() can put them back.
+    // An output the pacer opens later is opened non-blocking.
+    if(t->buffer_fd>=0) {
+        int flags = fcntl(t->buffer_fd, F_GETFL);
+        if(flags<0 || fcntl(t->buffer_fd, F_SETFL, flags|O_NONBLOCK)<0) {
+            err_print("cannot set non-blocking output: %s\n", strerror(errno));
+        }
+        else {
+            t->buffer_fd_flags = flags;
+        }
+    }
+
+    t->ctl_t1 = mono_now_ns();
+    clock_gettime(CLOCK_MONOTONIC, &t->deadline);
+    smooth_timespec_add_ns(&t->deadline, t->write_interval_ms * 1000000L);
+}
+
+// write one chunk, called when t->deadline is reached.
+// t->deadline is moved to the next tick.
+void smooth_tick(smooth_t *t)
+{
+    long bytes;
+    unsigned long level;
+    long interval_ns = t->write_interval_ms * 1000000L;
+    long late_us, ticks = 1;
+    int bucket;
+    struct timespec now;
+    long t2;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    t->write_clock++;
+
+    late_us = smooth_timespec_diff_ns(&t->deadline, &now) / 1000;
+    if(late_us<0) late_us = 0;
+    for(bucket=0; bucket<LATENESS_BUCKETS-1 && late_us>=(1L<<bucket); ++bucket);
+    t->lateness_hist[bucket]++;
+    if(late_us > t->lateness_max_us) t->lateness_max_us = late_us;
+
+    // keep our pace: write chunk bytes in each interval
+    smooth_timespec_add_ns(&t->deadline, interval_ns);
+
+    // missed whole ticks, write their chunks now
+    if(late_us*1000 >= interval_ns) {
+        long missed = late_us*1000 / interval_ns;
+
+        if(missed > MAX_CATCHUP_TICKS) {
+            t->skipped_ticks += missed - MAX_CATCHUP_TICKS;
+            ticks += MAX_CATCHUP_TICKS;
+        }
+        else {
+            ticks += missed;
+        }
+        t->catchup_ticks += ticks - 1;
+        smooth_timespec_add_ns(&t->deadline, missed*interval_ns);
+    }
+
+    bytes = t->write_chunk_bytes * ticks;
+
+    // gather this chunk from the ring into one writev(),
+    // data may wrap around the end of the ring
+    struct iovec iov[2];
+    int iovcnt = byte_ring_peekv(&t->ring, iov, bytes);
+    long size = 0;
+    ssize_t written;
+
+    if(iovcnt>0) size = iov[0].iov_len + (iovcnt>1 ? iov[1].iov_len : 0);
+    if(size < bytes) {
+        //dbg_print("queue empty\n");
+        t->underflow_bytes += bytes - size;
+    }
+
+    written = 0;
+    if(size>0) {
+        written = writev(t->buffer_fd, iov, iovcnt);
+        if(written<0) {
+            if(EAGAIN!=errno && EWOULDBLOCK!=errno && EINTR!=errno) {
+                if(0==t->write_errors++) {
+                    err_print("write failed: %s\n", strerror(errno));
+                }
+            }
+            written = 0;
+        }
+
+        // short write: consumer is not keeping up, leave the rest in queue
+        if(written < size) {
+            t->backpressure_ticks++;
+            t->backpressure_bytes += size - written;
+        }
+
+        t->total_out_bytes += written;
+        t->ctl_out_bytes += written;
+    }
+    byte_ring_consume(&t->ring, written);
+
+
+    // monitor actual byte rate 
+    // if too far with average incoming byte rate, adjust consumption speed
+    t2 = mono_now_ns();
+    long diff_ms = mono_interval_in_ms(t->ctl_t1, t2);
+    if(diff_ms<CTL_PERIOD_MS) return;
+
+    // diff_ms >= CTL_PERIOD_MS
+    long average_out_rate = t->ctl_out_bytes * 1000 / diff_ms;
+    dbg_print("re-calculate out rate %ld/%ld=%ld\n", t->ctl_out_bytes, diff_ms, average_out_rate);
+
+    level = byte_ring_level(&t->ring);
+    if(t->buffer_highest_level <= level) {
+        t->buffer_highest_level = level;
+    }
+    dbg_print("curr level %ld, highest level %ld\n", level, t->buffer_highest_level);
+
+    control_consumption_rate(t, level, diff_ms, average_out_rate);
+
+    // reset stop watch
+    t->ctl_t1 = t2;
+    t->ctl_out_bytes = 0;
+}
+
+static void *buffer_thread_routine(void *data)
+{
+    smooth_t *t = (smooth_t *)data;
+
+    dbg_print("buffer thread started\n");
+
+    // write one chunk in every loop
+    while(1) {
+        while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t->deadline, NULL)==EINTR);
+        smooth_tick(t);
+    } // end of thread loop
+
+    return NULL;
+}
+
+// end priming: set consumption speed from what came in so far, and
+// start pacing
+void smooth_write_start(smooth_t *t)
+{
+    long diff_ms;
+
+    if(e_Buffer_Priming!=t->buffer_state) return;
+
+    diff_ms = mono_interval_in_ms(t->priming_start, mono_now_ns());
+    if(diff_ms<=0) diff_ms = 1;
+
+    t->buffer_state = e_Buffer_Normal;
+    dbg_print("priming --> normal\n");
+
+    // determine consumption speed
+    t->write_byte_rate = byte_ring_level(&t->ring)*1000/diff_ms;
+    t->first_write_byte_rate = t->write_byte_rate;
+    t->incoming_byte_rate = t->write_byte_rate;
+    t->write_interval_ms = t->initial_interval_ms;
+    t->write_chunk_bytes = t->write_byte_rate / (1000/t->write_interval_ms);    
+    dbg_print("write rate %ld, chunk size=%ld, current level=%ld, %ld\n",
+            t->write_byte_rate, t->write_chunk_bytes,
+            byte_ring_level(&t->ring), diff_ms);
+
+    smooth_pacing_begin(t);
+
+    if(t->pacer) {
+        t->pacer(t, t->pacer_arg);
+        return;
+    }
+
+    // create consumer thread
+    int ret = pthread_create(&t->buffer_thread, NULL, buffer_thread_routine, t);
+    if(ret!=0) {
+        err_print("cannot create thread: %s\n", strerror(ret));
+        assert(0);
+    }
+}
+
+size_t smooth_write(smooth_t *t, int fd, const void *buf, size_t nbyte)
+{
+    // State: init --> priming
+    if(e_Buffer_Init==t->buffer_state) {
+        t->buffer_fd = fd;
+
+        t->priming_start = mono_now_ns();
+        rate_est_init(&t->incoming, t->priming_start);
+        push_to_queue(t, fd, buf, nbyte);
+        t->buffer_state = e_Buffer_Priming;
+
+        dbg_print("init --> priming\n");
+    }
+    // State: priming
+    else if(e_Buffer_Priming==t->buffer_state) {
+        // nothing drains the queue while priming, a blocking push into a
+        // full queue would wait forever. Start pacing what is there now.
+        if(e_Full_Block==t->full_policy && byte_ring_space(&t->ring) < nbyte) {
+            smooth_write_start(t);
+        }
+        push_to_queue(t, fd, buf, nbyte);
+
+        long diff_ms = mono_interval_in_ms(t->priming_start, mono_now_ns());
+
+        // State: priming --> normal
+        if(diff_ms >= 700) {
+            smooth_write_start(t);
+        }
+    }
+    else if(e_Buffer_Normal==t->buffer_state) {
+        push_to_queue(t, fd, buf, nbyte);
+    }
+    else {
+        assert(0);
+    }   
+
+    return nbyte;
+}
+
+smooth_t *smooth_write_init(unsigned long queue_size, enum smooth_full_policy full_policy)
+{
+    smooth_t *t = malloc(sizeof(smooth_t));
+    if(NULL==t) return NULL;
+    memset(t, 0, sizeof(smooth_t));
+
+    if(byte_ring_init(&t->ring, queue_size)<0) {
+        free(t);
+        return NULL;
+    }
+
+    // initialized parameters
+    // no need to calibrate the interval, the pacing clock uses absolute
+    // deadlines and does not accumulate scheduling overshoot
+    t->verbose = 1;
+    t->initial_interval_ms = 10;
+    t->buffer_fd = -1;
+    t->buffer_fd_flags = -1;
+    t->buffer_state = e_Buffer_Init;
+    t->full_policy = full_policy;
+
+    t->target_delay_ms = CTL_TARGET_DELAY_MS_DEFAULT;
+    t->ctl_kp = CTL_KP_DEFAULT;
+    t->ctl_ki = CTL_KI_DEFAULT;
+    t->ctl_max_slew = CTL_MAX_SLEW_DEFAULT;
+
+    return t;
+}
+
+// use an external pacer instead of a pacing thread. pacer is called when
+// priming ends, after which smooth_tick() must be called each time
+// t->deadline is reached.
+void smooth_write_set_pacer(smooth_t *t, smooth_pacer_fn pacer, void *arg)
+{
+    t->pacer = pacer;
+    t->pacer_arg = arg;
+}
+
+unsigned long smooth_write_level(smooth_t *t)
+{
+    return byte_ring_level(&t->ring);
+}
+
+// set rate controller parameters, call before first smooth_write()
+void smooth_write_set_controller(smooth_t *t, unsigned long target_delay_ms,
+                        double kp, double ki, int max_slew)
+{
+    t->target_delay_ms = target_delay_ms;
+    t->ctl_kp = kp;
+    t->ctl_ki = ki;
+    t->ctl_max_slew = max_slew;
+
+    dbg_print("target delay %ld ms, kp=%.3f, ki=%.3f, max slew %d%%/sec\n",
+            target_delay_ms, kp, ki, max_slew);
+}
+
+// give buffer_fd back the file status flags it had before pacing began
+void smooth_write_close(smooth_t *t)
+{
+    if(t->buffer_fd_flags<0) return;
+    if(fcntl(t->buffer_fd, F_SETFL, t->buffer_fd_flags)<0) {
+        err_print("cannot restore output flags: %s\n", strerror(errno));
+    }
+    t->buffer_fd_flags = -1;
+}
+
+void smooth_write_report(smooth_t *t)
+{
+    int i;
+
+    err_print("%ld bytes in, %ld bytes out, current level %ld, highest level %ld\n",
+            t->total_in_bytes, t->total_out_bytes, byte_ring_level(&t->ring),
+            t->buffer_highest_level);
+    for(i=0; i<e_Full_PolicyMax; ++i) {
+        if(0==t->full_count[i]) continue;
+        err_print("queue full: %s fired %ld times for %ld bytes\n",
+                smooth_full_policy_names[i], t->full_count[i], t->full_bytes[i]);
+    }
+    err_print("underflow %ld bytes, backpressure %ld bytes in %ld ticks, %ld write errors\n",
+            t->underflow_bytes, t->backpressure_bytes, t->backpressure_ticks,
+            t->write_errors);
+    err_print("%ld ticks, %ld caught up, %ld skipped, max lateness %ld us\n",
+            t->write_clock, t->catchup_ticks, t->skipped_ticks, t->lateness_max_us);
+    err_print("tick lateness histogram:\n");
+    for(i=0; i<LATENESS_BUCKETS; ++i) {
+        if(0==t->lateness_hist[i]) continue;
+        if(i<LATENESS_BUCKETS-1) {
+            err_print("  < %8ld us: %ld\n", 1L<<i, t->lateness_hist[i]);
+        }
+        else {
+            err_print(" >= %8ld us: %ld\n", 1L<<(i-1), t->lateness_hist[i]);
+        }
+    }
+}
@@ -0,0 +1,171 @@
+#ifndef __SMOOTH_H__
+#define __SMOOTH_H__
+
+#include <sys/types.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "rate.h"
+
+// ==========================================================================
+// Smooth buffering: queue a bursty input and write it out at a constant,
+// controlled rate.
+//
+// By default each smooth_t owns a pacing thread, started when priming ends.
+// A program pacing many streams can install its own pacer with
+// smooth_write_set_pacer() and call smooth_tick() whenever the stream's
+// deadline is reached.
+
+// Single-producer/single-consumer byte ring. Only the reader moves head and
+// the pacing thread moves tail, so neither side ever waits for the other.
+// Both are free running byte counters; the position in buffer is the
+// counter modulo size. The ring size is the hard memory cap of the queue.
+//
+// To drop the oldest data the reader may also move tail forward. While
+// the pacing thread writes data out it publishes the position it reads
+// from in "reading", and the reader never overwrites data beyond it.
+#define RING_SIZE_DEFAULT (16*1024*1024)
+#define RING_NOT_READING (~0UL)
+struct byte_ring {
+    char *buffer;
+    unsigned long size;
+
+    atomic_ulong head; // total bytes pushed
+    atomic_ulong tail; // total bytes popped or dropped
+    atomic_ulong reading; // tail being written out, or RING_NOT_READING
+    unsigned long read_pos; // consumer private copy of "reading"
+};
+
+// what to do when the queue is full
+enum smooth_full_policy {
+    e_Full_Block,       // wait for room, backpressure to upstream
+    e_Full_DropOldest,  // discard oldest queued data
+    e_Full_DropNewest,  // discard incoming data
+    e_Full_PolicyMax,
+};
+extern const char *smooth_full_policy_names[e_Full_PolicyMax];
+
+// Pacing ticks are scheduled on absolute CLOCK_MONOTONIC deadlines, so
+// oversleeping one tick does not push back the following ones. When the
+// pacing thread falls behind, up to MAX_CATCHUP_TICKS missed ticks are
+// written in one go; beyond that the schedule is moved forward.
+#define MAX_CATCHUP_TICKS 5
+// Output rate is driven by a PI controller on buffer occupancy, which
+// aims to hold target_delay_ms worth of incoming data in the queue.
+#define CTL_PERIOD_MS 500
+#define CTL_TARGET_DELAY_MS_DEFAULT 500
+#define CTL_KP_DEFAULT 0.5      // 1/sec, fraction of level error drained per second
+#define CTL_KI_DEFAULT 0.05     // 1/sec^2
+#define CTL_MAX_SLEW_DEFAULT 10 // percent of rate per second
+
+// lateness histogram, bucket i counts ticks late by less than 2^i usec,
+// the last bucket counts everything later
+#define LATENESS_BUCKETS 18
+
+typedef struct smooth_t smooth_t;
+typedef void (*smooth_pacer_fn)(smooth_t *t, void *arg);
+
+struct smooth_t {
+
+    // prefix of log messages, and whether to log rate changes
+    char name[32];
+    int verbose;
+
+    // incoming data queued for pacing
+    struct byte_ring ring;
+    enum smooth_full_policy full_policy;
+    // times each policy fired, and bytes it blocked or dropped
+    unsigned long full_count[e_Full_PolicyMax];
+    unsigned long full_bytes[e_Full_PolicyMax];
+
+    // highest buffer level (water level) seen by pacing thread
+    unsigned long buffer_highest_level;// = 0;
+    // the constant consumption we try to achieve
+    // g_write_byte_rate will directly affect g_write_interval_ms and g_write_chunk_bytes
+    unsigned long write_byte_rate;// = 0;
+    unsigned long first_write_byte_rate;// = 0;
+
+    unsigned long write_interval_ms;// = 0;
+    unsigned long write_chunk_bytes;// = 0;
+    unsigned long write_clock;// = 0;
+
+    int initial_interval_ms; // = 10;
+    int buffer_fd; // = -1;
+    int buffer_fd_flags; // = -1, restored by smooth_write_close()
+
+    // next tick deadline on CLOCK_MONOTONIC
+    struct timespec deadline;
+
+    // pacing clock statistics
+    unsigned long lateness_hist[LATENESS_BUCKETS];
+    unsigned long lateness_max_us;
+    unsigned long catchup_ticks;
+    unsigned long skipped_ticks;
+
+    // output statistics. buffer_fd is non-blocking, bytes it can not take
+    // stay in queue and are counted as backpressure
+    unsigned long total_in_bytes;
+    unsigned long total_out_bytes;
+    unsigned long underflow_bytes;
+    unsigned long backpressure_ticks;
+    unsigned long backpressure_bytes;
+    unsigned long write_errors;
+
+    // incoming rate estimator, only touched by the reader
+    struct rate_est incoming;
+    unsigned long incoming_byte_rate; // = 0;
+
+    // rate controller settings and state
+    unsigned long target_delay_ms;
+    double ctl_kp;
+    double ctl_ki;
+    int ctl_max_slew;
+    double ctl_integral; // integral of level error, byte*sec
+    long ctl_t1; // start of current control period, mono_now_ns()
+    unsigned long ctl_out_bytes; // bytes written in current control period
+
+    // threading controls
+    // thread handle, when there is no external pacer
+    pthread_t buffer_thread;
+    smooth_pacer_fn pacer;
+    void *pacer_arg;
+
+    long priming_start; // mono_now_ns()
+
+    enum {
+        e_Buffer_Init,
+        e_Buffer_Priming,
+        e_Buffer_Normal,
+    } buffer_state;
+};
+
+static inline void smooth_timespec_add_ns(struct timespec *ts, long ns)
+{
+    ts->tv_sec += ns / 1000000000L;
+    ts->tv_nsec += ns % 1000000000L;
+    if(ts->tv_nsec >= 1000000000L) {
+        ts->tv_nsec -= 1000000000L;
+        ts->tv_sec++;
+    }
+}
+
+// return (pt2 - pt1) in nano seconds
+static inline long smooth_timespec_diff_ns(const struct timespec *pt1,
+                        const struct timespec *pt2)
+{
+    return (pt2->tv_sec - pt1->tv_sec)*1000000000L + (pt2->tv_nsec - pt1->tv_nsec);
+}
+
+smooth_t *smooth_write_init(unsigned long queue_size, enum smooth_full_policy full_policy);
+void smooth_write_set_controller(smooth_t *t, unsigned long target_delay_ms,
+                        double kp, double ki, int max_slew);
+void smooth_write_set_pacer(smooth_t *t, smooth_pacer_fn pacer, void *arg);
+size_t smooth_write(smooth_t *t, int fd, const void *buf, size_t nbyte);
+void smooth_write_start(smooth_t *t);
+void smooth_tick(smooth_t *t);
+unsigned long smooth_write_level(smooth_t *t);
+void smooth_write_close(smooth_t *t);
+void smooth_write_report(smooth_t *t);
+
+#endif //__SMOOTH_H__
@@ -5,36 +5,25 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
-#include <sys/time.h>
 #include <assert.h>
 #include <pthread.h>
 #include <signal.h>
+#include <getopt.h>
 
-#define MODULE "[smoother]"
-
-static unsigned long get_time_interval_in_ms(const struct timeval *pt1,
-                        const struct timeval *pt2)
-{
-    unsigned long diff_in_ms;
+#include "monoclock.h"
 
-    diff_in_ms = (pt2->tv_sec - pt1->tv_sec)*1000;
-    
-    if(pt2->tv_usec < pt1->tv_usec) {
-        diff_in_ms -= 1000; // borrow 1 second to pt2
-        diff_in_ms += (pt2->tv_usec+1000000 - pt1->tv_usec)/1000;
-    }
-    else {
-        diff_in_ms += (pt2->tv_usec-pt1->tv_usec)/1000;
-    }
-
-    return diff_in_ms;
-}
+#define MODULE "[smoother]"
 
 // ==========================================================================
 // Start of smooth buffering
 
+// Nodes come from a preallocated pool and drained nodes are put back to
+// the pool's free list. Payload memory is never zeroed. When the pool is
+// exhausted, more nodes are malloc'ed and they join the pool when drained.
+#define NODE_PAYLOAD_SIZE (4*1024)
+#define POOL_NODES_DEFAULT 1024
 struct buffer_node {
-    char *buffer;
+    char buffer[NODE_PAYLOAD_SIZE];
     size_t start;
     size_t nbyte;
 
@@ -45,6 +34,35 @@ struct buffer_node {
 // pointer to queue head (incoming) and tail (outgoing)
 static struct buffer_node *g_queue_head=NULL, *g_queue_tail=NULL;
 
+// node pool, free list is linked with "next"
+static struct buffer_node *g_pool_free = NULL;
+static unsigned long g_pool_nodes = POOL_NODES_DEFAULT;
+static unsigned long g_pool_in_use = 0;
+static unsigned long g_pool_peak_in_use = 0;
+static unsigned long g_pool_exhausted = 0;
+// lock to protect: g_pool_*
+static pthread_mutex_t g_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Hard cap of queued bytes, and what to do when it is reached
+#define BUFFER_CAP_DEFAULT (16*1024*1024)
+static unsigned long g_buffer_cap = BUFFER_CAP_DEFAULT;
+enum full_policy {
+    e_Full_Block,       // wait for room, backpressure to upstream
+    e_Full_DropOldest,  // discard oldest queued data
+    e_Full_DropNewest,  // discard incoming data
+    e_Full_PolicyMax,
+} g_full_policy = e_Full_DropNewest;
+static const char *g_full_policy_names[e_Full_PolicyMax] = {
+    "block", "oldest", "newest",
+};
+// times each policy fired, and bytes it blocked or dropped
+static unsigned long g_full_count[e_Full_PolicyMax];
+static unsigned long g_full_bytes[e_Full_PolicyMax];
+// node the buffer thread is writing out, it can not be dropped
+static struct buffer_node *g_writing_node = NULL;
+// signaled when buffer thread takes data out of queue
+static pthread_cond_t g_buffer_space = PTHREAD_COND_INITIALIZER;
+
 // When buffer level is above g_buffer_max_level, do whatever we can to reduce 
 // to "what"(?) level.
 #define BUFFER_MAX (50*1024)
@@ -77,7 +95,7 @@ pthread_t g_buffer_thread;
 // lock to protect: g_buffer_curr_level, g_queue_head, g_queue_tail
 pthread_mutex_t g_buffer_lock;
 
-struct timeval g_priming_start, g_priming_end;
+long g_priming_start, g_priming_end;
 
 enum {
     e_Buffer_Init,
@@ -85,17 +103,55 @@ enum {
     e_Buffer_Normal,
 } g_buffer_state = e_Buffer_Init;
 
+static void buffer_pool_init(unsigned long nodes)
+{
+    struct buffer_node *pool = malloc(nodes * sizeof(struct buffer_node));
+    unsigned long i;
+
+    assert(pool);
+
+    for(i=0; i<nodes; ++i) {
+        pool[i].next = g_pool_free;
+        g_pool_free = &pool[i];
+    }
+    g_pool_nodes = nodes;
+}
+
+static void buffer_pool_report(void)
+{
+    fprintf(stderr, "%s pool %ld nodes of %d bytes, in use %ld, peak %ld, exhausted %ld times\n",
+            MODULE, g_pool_nodes, NODE_PAYLOAD_SIZE,
+            g_pool_in_use, g_pool_peak_in_use, g_pool_exhausted);
+}
+
 static struct buffer_node *buffer_node_allocate(const void *buf, size_t nbyte)
 {
-    struct buffer_node *node = malloc(sizeof(struct buffer_node));
+    struct buffer_node *node;
 
-    assert(node);
+    assert(nbyte <= NODE_PAYLOAD_SIZE);
+
+    pthread_mutex_lock(&g_pool_lock);
+    node = g_pool_free;
+    if(node) {
+        g_pool_free = node->next;
+    }
+    else {
+        g_pool_exhausted++;
+        g_pool_nodes++;
+    }
+    if(++g_pool_in_use > g_pool_peak_in_use) {
+        g_pool_peak_in_use = g_pool_in_use;
+    }
+    pthread_mutex_unlock(&g_pool_lock);
+
+    if(NULL==node) {
+        node = malloc(sizeof(struct buffer_node));
+        assert(node);
+    }
 
     node->prev = node->next = NULL;
     node->start = 0;
     node->nbyte = nbyte;
-    node->buffer = malloc(nbyte);
-    assert(node->buffer);
     memcpy(node->buffer, buf, nbyte);
 
     return node;
@@ -104,19 +160,97 @@ static struct buffer_node *buffer_node_allocate(const void *buf, size_t nbyte)
 static void buffer_node_free(struct buffer_node *node)
 {
     assert(node);
-    assert(node->buffer);
 
-    free(node->buffer);
-    free(node);
+    pthread_mutex_lock(&g_pool_lock);
+    node->next = g_pool_free;
+    g_pool_free = node;
+    g_pool_in_use--;
+    pthread_mutex_unlock(&g_pool_lock);
 }
 
+static void push_node_to_queue(int fd, const void *buf, size_t nbyte);
+
+// split buffer into nodes of at most NODE_PAYLOAD_SIZE bytes
 static void push_to_queue(int fd, const void *buf, size_t nbyte)
+{
+    while(nbyte > NODE_PAYLOAD_SIZE) {
+        push_node_to_queue(fd, buf, NODE_PAYLOAD_SIZE);
+        buf = (const char *)buf + NODE_PAYLOAD_SIZE;
+        nbyte -= NODE_PAYLOAD_SIZE;
+    }
+    push_node_to_queue(fd, buf, nbyte);
+}
+
+static void buffer_full_report(void)
+{
+    int i;
+
+    for(i=0; i<e_Full_PolicyMax; ++i) {
+        if(0==g_full_count[i]) continue;
+        fprintf(stderr, "%s queue full: %s fired %ld times for %ld bytes\n", MODULE,
+                g_full_policy_names[i], g_full_count[i], g_full_bytes[i]);
+    }
+}
+
+// called with g_buffer_lock held when nbyte more bytes would go beyond
+// g_buffer_cap. return 1 if the new data can be queued, 0 to drop it.
+static int buffer_make_room(size_t nbyte)
+{
+    struct buffer_node *node, *prev;
+
+    if(0==g_full_count[g_full_policy]) {
+        fprintf(stderr, "%s queue full (%ld bytes), policy %s\n", MODULE,
+                g_buffer_cap, g_full_policy_names[g_full_policy]);
+    }
+
+    if(nbyte > g_buffer_cap) {
+        // never fits, drop it
+    }
+    else if(e_Full_Block==g_full_policy) {
+        g_full_count[e_Full_Block]++;
+        g_full_bytes[e_Full_Block] += nbyte;
+        while(g_buffer_curr_level + nbyte > g_buffer_cap) {
+            pthread_cond_wait(&g_buffer_space, &g_buffer_lock);
+        }
+        return 1;
+    }
+    else if(e_Full_DropOldest==g_full_policy) {
+        g_full_count[e_Full_DropOldest]++;
+        for(node=g_queue_tail; node && g_buffer_curr_level+nbyte > g_buffer_cap; node=prev) {
+            prev = node->prev;
+            if(node==g_writing_node) continue;
+
+            if(node->prev) node->prev->next = node->next;
+            else g_queue_head = node->next;
+            if(node->next) node->next->prev = node->prev;
+            else g_queue_tail = node->prev;
+
+            g_buffer_curr_level -= node->nbyte;
+            g_full_bytes[e_Full_DropOldest] += node->nbyte;
+            buffer_node_free(node);
+        }
+        if(g_buffer_curr_level + nbyte <= g_buffer_cap) return 1;
+        // only the node being written is left, drop new data instead
+    }
+
+    g_full_count[e_Full_DropNewest]++;
+    g_full_bytes[e_Full_DropNewest] += nbyte;
+    return 0;
+}
+
+static void push_node_to_queue(int fd, const void *buf, size_t nbyte)
 {
     struct buffer_node *newnode = buffer_node_allocate(buf, nbyte);
 
     //fprintf(stderr, "%s + push to Q %ld\n", MODULE, nbyte);
     pthread_mutex_lock(&g_buffer_lock);
 
+    if(g_buffer_curr_level + nbyte > g_buffer_cap && !buffer_make_room(nbyte)) {
+        pthread_mutex_unlock(&g_buffer_lock);
+        buffer_node_free(newnode);
+        return;
+    }
+
     // when queue is empty
     if(g_queue_head==NULL && g_queue_tail==NULL) {
         g_queue_head = g_queue_tail = newnode;
@@ -158,10 +292,11 @@ void *buffer_thread_routine(void *data)
 {
     unsigned long last_rate_adjust_clock = 0; 
     unsigned long total_bytes = 0;
-    struct timeval t1; //, t2;
+#if 0
+    long t1 = mono_now_ns(), t2;
+#endif
 
     fprintf(stderr, "%s buffer thread started\n", MODULE);
-    gettimeofday(&t1, NULL);
 
     // write one chunk in every loop
     while(1) {
@@ -176,8 +311,8 @@ void *buffer_thread_routine(void *data)
         g_write_clock++;
 
 #if 0
-        gettimeofday(&t2, NULL);
-        long diff_ms = get_time_interval_in_ms(&t1, &t2);
+        t2 = mono_now_ns();
+        long diff_ms = mono_interval_in_ms(t1, t2);
         
         if((g_write_clock % 2) == 0) {
             fprintf(stderr, "%s @%ld ms, level %ld\n", MODULE, 
@@ -204,6 +339,10 @@ void *buffer_thread_routine(void *data)
                 if(NULL==g_queue_tail) {
                     g_queue_head = NULL; // removed last node, now queue is empty
                 }
+                else {
+                    g_queue_tail->next = NULL;
+                }
+                pthread_cond_signal(&g_buffer_space);
                 pthread_mutex_unlock(&g_buffer_lock);
 
                 write(g_buffer_fd, node->buffer+node->start, node->nbyte);
@@ -215,6 +354,7 @@ void *buffer_thread_routine(void *data)
             // keep this node in queue and write out "bytes" of data.
             else {
                 g_buffer_curr_level -= bytes;
+                g_writing_node = node;
                 pthread_mutex_unlock(&g_buffer_lock);
 
                 write(g_buffer_fd, node->buffer+node->start, bytes);
@@ -222,6 +362,11 @@ void *buffer_thread_routine(void *data)
                 node->start += bytes;
                 node->nbyte -= bytes;
                 bytes = 0;
+
+                pthread_mutex_lock(&g_buffer_lock);
+                g_writing_node = NULL;
+                pthread_cond_signal(&g_buffer_space);
+                pthread_mutex_unlock(&g_buffer_lock);
             }
         } // end of writing bytes
 
@@ -258,6 +403,30 @@ void *buffer_thread_routine(void *data)
     return NULL;
 }
 
+// State: priming --> normal. Set consumption speed from what came in
+// during diff_ms of priming and start the consumer thread.
+static void start_pacing(long diff_ms)
+{
+    g_buffer_state = e_Buffer_Normal;
+
+    fprintf(stderr, "%s priming --> normal\n", MODULE);
+    g_write_byte_rate = g_buffer_curr_level*1000/diff_ms;
+    g_first_write_byte_rate = g_write_byte_rate;
+    g_write_interval_ms = g_initial_interval_ms;
+    g_write_chunk_bytes = g_write_byte_rate / (1000/g_write_interval_ms);    
+    fprintf(stderr, "%s write rate %ld, chunk size=%ld, current level=%ld, %ld\n",
+            MODULE,
+            g_write_byte_rate, g_write_chunk_bytes,
+            g_buffer_curr_level, diff_ms);
+
+    // create consumer thread
+    int ret = pthread_create(&g_buffer_thread, NULL, buffer_thread_routine, NULL);
+    if(ret<0) {
+        fprintf(stderr, "%s cannot create thread: %s\n", MODULE, strerror(errno));
+        assert(0);
+    }
+}
+
 static size_t smooth_write(int fd, const void *buf, size_t nbyte)
 {
     // State: init --> priming
@@ -266,7 +435,7 @@ static size_t smooth_write(int fd, const void *buf, size_t nbyte)
 
         pthread_mutex_init(&g_buffer_lock, NULL);
 
-        gettimeofday(&g_priming_start, NULL);
+        g_priming_start = mono_now_ns();
         push_to_queue(fd, buf, nbyte);
         g_buffer_state = e_Buffer_Priming;
 
@@ -275,31 +444,25 @@ static size_t smooth_write(int fd, const void *buf, size_t nbyte)
     // State: priming
     else if(e_Buffer_Priming==g_buffer_state) {
 
+        // nothing drains the queue while priming, a blocking push into a
+        // full queue would wait forever. Start pacing what is there now.
+        if(e_Full_Block==g_full_policy && nbyte <= g_buffer_cap
+                && g_buffer_curr_level + nbyte > g_buffer_cap) {
+            long diff_ms = mono_interval_in_ms(g_priming_start, mono_now_ns());
+            start_pacing(diff_ms>0 ? diff_ms : 1);
+        }
         push_to_queue(fd, buf, nbyte);
 
+        // calculate incoming rate
+        g_priming_end = mono_now_ns();
+        long diff_ms = mono_interval_in_ms(g_priming_start, g_priming_end);
+
         // State: priming --> normal
-        if(g_buffer_curr_level >= g_buffer_start_level) {
-            g_buffer_state = e_Buffer_Normal;
-
-            fprintf(stderr, "%s priming --> normal\n", MODULE);
-            // calculate incoming rate
-            gettimeofday(&g_priming_end, NULL);
-            long diff_ms = get_time_interval_in_ms(&g_priming_start, &g_priming_end);
-            g_write_byte_rate = g_buffer_curr_level*1000/diff_ms;
-            g_first_write_byte_rate = g_write_byte_rate;
-            g_write_interval_ms = g_initial_interval_ms;
-            g_write_chunk_bytes = g_write_byte_rate / (1000/g_write_interval_ms);    
-            fprintf(stderr, "%s write rate %ld, chunk size=%ld, current level=%ld, %ld\n",
-                    MODULE,
-                    g_write_byte_rate, g_write_chunk_bytes,
-                    g_buffer_curr_level, diff_ms);
-
-            // create consumer thread
-            int ret = pthread_create(&g_buffer_thread, NULL, buffer_thread_routine, NULL);
-            if(ret<0) {
-                fprintf(stderr, "%s cannot create thread: %s\n", MODULE, strerror(errno));
-                assert(0);
-            }
+        // a burst may fill the start level within the same milli second,
+        // keep priming until the rate can be measured
+        if(e_Buffer_Priming==g_buffer_state
+                && g_buffer_curr_level >= g_buffer_start_level && diff_ms>0) {
+            start_pacing(diff_ms);
         }
     }
     else if(e_Buffer_Normal==g_buffer_state) {
@@ -312,15 +475,17 @@ static size_t smooth_write(int fd, const void *buf, size_t nbyte)
     return nbyte;
 }
 
-void smooth_write_init(void)
+void smooth_write_init(unsigned long pool_nodes)
 {
-    struct timeval t1, t2;
+    long t1, t2;
+
+    buffer_pool_init(pool_nodes);
 
-    gettimeofday(&t1, NULL);
+    t1 = mono_now_ns();
     usleep(g_initial_interval_ms*1000);
-    gettimeofday(&t2, NULL);
+    t2 = mono_now_ns();
 
-    long diff_ms = get_time_interval_in_ms(&t1, &t2);
+    long diff_ms = mono_interval_in_ms(t1, t2);
     // this is due to system scheduling, so we typically sleep longer than 
     // requested.
     fprintf(stderr, "%s adjust initial interval from %d to %ld\n", MODULE,
@@ -335,14 +500,56 @@ void signal_handler(int signo)
 {
     fprintf(stderr, "%s signal %d received\n", MODULE, signo); 
     fprintf(stderr, "%s current level %ld\n", MODULE, g_buffer_curr_level); 
+    buffer_pool_report();
+    buffer_full_report();
     exit(0);
 }
 
 int main(int argc, char **argv)
 {
     char buf[4096];
+    unsigned long pool_nodes = POOL_NODES_DEFAULT;
+
+    while(1) {
+        int c;
+
+        if( -1 == (c = getopt(argc, argv, "?hp:m:f:")) ) break;
+
+        switch(c) {
+        case '?':
+        case 'h':
+            fprintf(stderr, "%s [-p pool_nodes] [-m max_bytes] [-f block|oldest|newest]\n", argv[0]);
+            fprintf(stderr, "-p number of %d-byte buffer nodes to preallocate, default %d\n",
+                    NODE_PAYLOAD_SIZE, POOL_NODES_DEFAULT);
+            fprintf(stderr, "-m maximum bytes in queue, default %d\n", BUFFER_CAP_DEFAULT);
+            fprintf(stderr, "-f when queue is full: block the reader, drop oldest or newest data.\n");
+            fprintf(stderr, "   default is newest\n");
+            fprintf(stderr, "\nThis tool smooths out bit rate of data from stdin to stdout\n\n");
+            exit(1);
+            break;
+
+        case 'p':
+            pool_nodes = strtoul(optarg, NULL, 0);
+            break;
+
+        case 'm':
+            g_buffer_cap = strtoul(optarg, NULL, 0);
+            break;
+
+        case 'f':
+            for(g_full_policy=0; g_full_policy<e_Full_PolicyMax; ++g_full_policy) {
+                if(0==strcmp(optarg, g_full_policy_names[g_full_policy])) break;
+            }
+            if(e_Full_PolicyMax==g_full_policy) {
+                fprintf(stderr, "unknown policy '%s'\n", optarg);
+                exit(1);
+            }
+            break;
+        }
+    }
 
-    smooth_write_init();
+    mono_clock_init();
+    smooth_write_init(pool_nodes);
     signal(SIGINT, signal_handler);
 
     while(1) {
@@ -357,6 +564,8 @@ int main(int argc, char **argv)
         }
         else if(sz==0) {
             fprintf(stderr, "%s EOL\n", MODULE);
+            buffer_pool_report();
+            buffer_full_report();
             fflush(stderr);
             break;
         }
@@ -0,0 +1,607 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <pthread.h>
+#include <signal.h>
+#include <getopt.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/epoll.h>
+
+#include "monoclock.h"
+#include "smooth.h"
+
+#define MODULE "[smoothmux]"
+
+// Pace many input/output pairs in one process.
+// Input is read by one epoll loop, and every stream is paced by one of a
+// few pacing threads. Each pacing thread runs a hierarchical timer wheel
+// with 1 ms ticks that holds the next deadline of its streams.
+
+#define MAX_STREAMS 1024
+#define MAX_PACERS 64
+
+// ==========================================================================
+// Start of timer wheel
+
+// WHEEL_LEVELS levels of WHEEL_SLOTS slots. Level 0 slots are 1 tick,
+// level 1 slots are WHEEL_SLOTS ticks and so on. Timers in a higher
+// level are cascaded down when the lower level wraps around.
+#define WHEEL_BITS 8
+#define WHEEL_SLOTS (1<<WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS-1)
+#define WHEEL_LEVELS 3
+
+struct wheel_timer {
+    unsigned long expires; // in ticks
+    void (*fn)(struct wheel_timer *timer);
+
+    struct wheel_timer *prev;
+    struct wheel_timer *next;
+};
+
+struct timer_wheel {
+    unsigned long now; // current tick, all timers up to it have fired
+    unsigned long count; // number of pending timers
+    struct wheel_timer slots[WHEEL_LEVELS][WHEEL_SLOTS]; // list heads
+};
+
+static void wheel_init(struct timer_wheel *w)
+{
+    int i, j;
+
+    w->now = 0;
+    w->count = 0;
+    for(i=0; i<WHEEL_LEVELS; ++i) {
+        for(j=0; j<WHEEL_SLOTS; ++j) {
+            w->slots[i][j].prev = w->slots[i][j].next = &w->slots[i][j];
+        }
+    }
+}
+
+static void wheel_link(struct timer_wheel *w, struct wheel_timer *timer)
+{
+    unsigned long delta;
+    struct wheel_timer *head;
+    int level;
+
+    delta = timer->expires - w->now;
+
+    for(level=0; level<WHEEL_LEVELS-1; ++level) {
+        if(delta < (1UL<<(WHEEL_BITS*(level+1)))) break;
+    }
+    // too far away, park in last slot reachable from the top level
+    if(delta >= (1UL<<(WHEEL_BITS*WHEEL_LEVELS))) {
+        timer->expires = w->now + (1UL<<(WHEEL_BITS*WHEEL_LEVELS)) - 1;
+    }
+
+    head = &w->slots[level][(timer->expires >> (WHEEL_BITS*level)) & WHEEL_MASK];
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+static void wheel_add(struct timer_wheel *w, struct wheel_timer *timer)
+{
+    // already due, fire on next tick
+    if(timer->expires <= w->now) timer->expires = w->now+1;
+    w->count++;
+    wheel_link(w, timer);
+}
+
+// move timers of one higher level slot down to where they belong now
+static void wheel_cascade(struct timer_wheel *w, int level)
+{
+    struct wheel_timer *head = &w->slots[level][(w->now >> (WHEEL_BITS*level)) & WHEEL_MASK];
+    struct wheel_timer *timer = head->next;
+
+    head->prev = head->next = head;
+    while(timer!=head) {
+        struct wheel_timer *next = timer->next;
+        wheel_link(w, timer);
+        timer = next;
+    }
+}
+
+// advance wheel to tick "to", calling fn of every expired timer.
+// fn may add the timer back.
+static void wheel_advance(struct timer_wheel *w, unsigned long to)
+{
+    while(w->now < to) {
+        struct wheel_timer *head, *timer;
+        int level;
+
+        w->now++;
+
+        // lower level wrapped, bring down timers of higher levels
+        for(level=1; level<WHEEL_LEVELS; ++level) {
+            if(w->now & ((1UL<<(WHEEL_BITS*level))-1)) break;
+        }
+        while(--level>0) {
+            wheel_cascade(w, level);
+        }
+
+        head = &w->slots[0][w->now & WHEEL_MASK];
+        while(head->next!=head) {
+            timer = head->next;
+            head->next = timer->next;
+            timer->next->prev = head;
+            w->count--;
+            timer->fn(timer);
+        }
+    }
+}
+
+// End of timer wheel
+// ==========================================================================
+
+struct pacer {
+    int id;
+    pthread_t thread;
+    // lock to protect: wheel
+    pthread_mutex_t lock;
+    struct timer_wheel wheel;
+    // CLOCK_MONOTONIC time of wheel tick 0
+    struct timespec base;
+};
+
+struct stream {
+    int id;
+    const char *in_path, *out_path;
+    int in_fd;
+    atomic_int out_fd; // -1 until a FIFO output has a reader
+    smooth_t *t;
+    struct pacer *pacer;
+    struct wheel_timer timer;
+    atomic_int eof;
+    atomic_int done; // output closed, after input end or a write error
+};
+
+static struct stream g_streams[MAX_STREAMS];
+static int g_stream_count = 0;
+static struct pacer g_pacers[MAX_PACERS];
+static int g_pacer_count = 1;
+static atomic_int g_done_count;
+static int g_verbose = 0;
+
+// tick of the wheel on or after ts
+static unsigned long pacer_tick_of(struct pacer *p, const struct timespec *ts)
+{
+    long ns = smooth_timespec_diff_ns(&p->base, ts);
+
+    if(ns<0) return 0;
+    return (ns + 999999) / 1000000;
+}
+
+static void stream_finish(struct stream *s)
+{
+    int fd;
+
+    if(atomic_exchange(&s->done, 1)) return;
+    smooth_write_close(s->t);
+    fd = atomic_load(&s->out_fd);
+    if(fd>=0) close(fd);
+    atomic_fetch_add(&g_done_count, 1);
+    if(g_verbose) {
+        fprintf(stderr, "%s stream %d done\n", MODULE, s->id);
+    }
+}
+
+// open output without blocking. A FIFO without reader fails with ENXIO,
+// return -1 for that and on other errors, which count as write errors.
+static int stream_open_output(struct stream *s)
+{
+    int fd = atomic_load(&s->out_fd);
+
+    if(fd>=0) return 0;
+    fd = open(s->out_path, O_WRONLY|O_CREAT|O_TRUNC|O_NONBLOCK, 0644);
+    if(fd<0) {
+        if(ENXIO!=errno) {
+            fprintf(stderr, "%s cannot open '%s' for writing: %s\n",
+                    MODULE, s->out_path, strerror(errno));
+            s->t->write_errors++;
+        }
+        return -1;
+    }
+    s->t->buffer_fd = fd;
+    atomic_store(&s->out_fd, fd);
+    if(g_verbose) {
+        fprintf(stderr, "%s stream %d output '%s' open\n", MODULE, s->id, s->out_path);
+    }
+    return 0;
+}
+
+// timer callback, called by pacer thread with pacer lock held
+static void stream_tick(struct wheel_timer *timer)
+{
+    struct stream *s = (struct stream *)((char *)timer - offsetof(struct stream, timer));
+    smooth_t *t = s->t;
+    int eof = atomic_load(&s->eof);
+
+    // no reader on the output yet, input keeps queueing by the full policy.
+    // Try again next tick.
+    if(stream_open_output(s)<0) {
+        if(t->write_errors) {
+            stream_finish(s);
+            return;
+        }
+        smooth_timespec_add_ns(&t->deadline, t->write_interval_ms * 1000000L);
+        timer->expires = pacer_tick_of(s->pacer, &t->deadline);
+        wheel_add(&s->pacer->wheel, timer);
+        return;
+    }
+
+    // without input the controller follows the incoming rate down towards
+    // zero, drain what is left at no less than the starting rate
+    if(eof) {
+        unsigned long drain = t->first_write_byte_rate * t->write_interval_ms / 1000;
+
+        if(0==drain) drain = smooth_write_level(t);
+        if(t->write_chunk_bytes < drain) t->write_chunk_bytes = drain;
+    }
+
+    smooth_tick(t);
+
+    // everything is written out after input is gone, or the output failed
+    // and never will be
+    if((eof && 0==smooth_write_level(t)) || t->write_errors) {
+        stream_finish(s);
+        return;
+    }
+
+    timer->expires = pacer_tick_of(s->pacer, &s->t->deadline);
+    wheel_add(&s->pacer->wheel, timer);
+}
+
+// smooth_t pacer hook, called from input loop when priming ends
+static void stream_start_pacing(smooth_t *t, void *arg)
+{
+    struct stream *s = (struct stream *)arg;
+    struct pacer *p = s->pacer;
+
+    pthread_mutex_lock(&p->lock);
+    s->timer.fn = stream_tick;
+    s->timer.expires = pacer_tick_of(p, &t->deadline);
+    wheel_add(&p->wheel, &s->timer);
+    pthread_mutex_unlock(&p->lock);
+}
+
+static void *pacer_thread_routine(void *data)
+{
+    struct pacer *p = (struct pacer *)data;
+    struct timespec next, now;
+
+    while(1) {
+        unsigned long tick;
+
+        // sleep to next tick, or a while longer when there is nothing to do
+        pthread_mutex_lock(&p->lock);
+        tick = p->wheel.now + (p->wheel.count ? 1 : 10);
+        pthread_mutex_unlock(&p->lock);
+
+        next = p->base;
+        smooth_timespec_add_ns(&next, tick * 1000000L);
+        while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL)==EINTR);
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        pthread_mutex_lock(&p->lock);
+        wheel_advance(&p->wheel, smooth_timespec_diff_ns(&p->base, &now) / 1000000);
+        pthread_mutex_unlock(&p->lock);
+    }
+
+    return NULL;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "%s [-j threads] [-q queue_size] [-f oldest|newest] [-d delay_ms] [-v] config\n", prog);
+    fprintf(stderr, "-j number of pacing threads, default 1\n");
+    fprintf(stderr, "-q maximum memory of pacing queue per stream in bytes, default %d\n",
+            RING_SIZE_DEFAULT);
+    fprintf(stderr, "-f when queue is full: drop oldest or newest data, default is newest.\n");
+    fprintf(stderr, "   block is accepted but stalls input of all streams\n");
+    fprintf(stderr, "-d default target buffering delay in milli seconds, default %d\n",
+            CTL_TARGET_DELAY_MS_DEFAULT);
+    fprintf(stderr, "-v log rate control of every stream\n");
+    fprintf(stderr, "config has one stream per line: \"input output [delay_ms]\"\n");
+    fprintf(stderr, "   input is a FIFO, output a file or FIFO, \"-\" is stdin or stdout\n");
+    fprintf(stderr, "   data for an output FIFO is queued until the FIFO has a reader\n");
+    fprintf(stderr, "\nThis tool smooths out bit rate of many streams\n\n");
+    exit(1);
+}
+
+static void read_config(const char *path, unsigned long default_delay_ms,
+                        unsigned long queue_size, enum smooth_full_policy full_policy)
+{
+    FILE *conf;
+    char line[1024];
+    int lineno = 0;
+
+    conf = fopen(path, "r");
+    if(NULL==conf) {
+        fprintf(stderr, "%s cannot open '%s': %s\n", MODULE, path, strerror(errno));
+        exit(1);
+    }
+
+    while(fgets(line, sizeof(line), conf)) {
+        char in[512], out[512];
+        unsigned long delay_ms = default_delay_ms;
+        struct stream *s;
+        int n;
+
+        lineno++;
+        if('#'==line[0]) continue;
+        n = sscanf(line, "%511s %511s %lu", in, out, &delay_ms);
+        if(n<=0) continue;
+        if(n<2) {
+            fprintf(stderr, "%s %s:%d: need input and output\n", MODULE, path, lineno);
+            exit(1);
+        }
+        if(g_stream_count>=MAX_STREAMS) {
+            fprintf(stderr, "%s too many streams, at most %d\n", MODULE, MAX_STREAMS);
+            exit(1);
+        }
+
+        s = &g_streams[g_stream_count];
+        s->id = g_stream_count;
+        s->in_path = strdup(in);
+        s->out_path = strdup(out);
+        s->pacer = &g_pacers[g_stream_count % g_pacer_count];
+
+        s->t = smooth_write_init(queue_size, full_policy);
+        if(NULL==s->t) {
+            fprintf(stderr, "%s cannot allocate context for stream %d\n", MODULE, s->id);
+            exit(1);
+        }
+        snprintf(s->t->name, sizeof(s->t->name), "[%d]", s->id);
+        s->t->verbose = g_verbose;
+        smooth_write_set_controller(s->t, delay_ms,
+                CTL_KP_DEFAULT, CTL_KI_DEFAULT, CTL_MAX_SLEW_DEFAULT);
+        smooth_write_set_pacer(s->t, stream_start_pacing, s);
+
+        g_stream_count++;
+    }
+
+    fclose(conf);
+}
+
+static void open_streams(int epfd)
+{
+    int i;
+
+    for(i=0; i<g_stream_count; ++i) {
+        struct stream *s = &g_streams[i];
+        struct epoll_event ev;
+
+        // FIFOs are opened without waiting for the other end, one stream
+        // must not hold up the next
+        s->in_fd = strcmp(s->in_path, "-") ? open(s->in_path, O_RDONLY|O_NONBLOCK) : 0;
+        if(s->in_fd<0) {
+            fprintf(stderr, "%s cannot open '%s' for reading: %s\n",
+                    MODULE, s->in_path, strerror(errno));
+            exit(1);
+        }
+        atomic_init(&s->out_fd, strcmp(s->out_path, "-") ? -1 : 1);
+        if(stream_open_output(s)<0) {
+            if(s->t->write_errors) exit(1);
+            if(g_verbose) {
+                fprintf(stderr, "%s stream %d waits for a reader on '%s'\n",
+                        MODULE, s->id, s->out_path);
+            }
+        }
+
+        fcntl(s->in_fd, F_SETFL, fcntl(s->in_fd, F_GETFL)|O_NONBLOCK);
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = s;
+        if(epoll_ctl(epfd, EPOLL_CTL_ADD, s->in_fd, &ev)<0) {
+            // e.g. EPERM for regular files
+            fprintf(stderr, "%s cannot poll '%s', input must be a pipe, FIFO or socket: %s\n",
+                    MODULE, s->in_path, strerror(errno));
+            exit(1);
+        }
+    }
+}
+
+// read everything available from stream input.
+// return 1 when input reached end of file.
+static int stream_read(struct stream *s)
+{
+    char buf[64*1024];
+
+    while(1) {
+        ssize_t sz = read(s->in_fd, buf, sizeof(buf));
+
+        if(sz>0) {
+            smooth_write(s->t, atomic_load(&s->out_fd), buf, sz);
+        }
+        else if(sz==0) {
+            return 1;
+        }
+        else if(EINTR==errno) {
+            continue;
+        }
+        else if(EAGAIN==errno || EWOULDBLOCK==errno) {
+            return 0;
+        }
+        else {
+            fprintf(stderr, "%s stream %d read failed: %s\n", MODULE, s->id, strerror(errno));
+            return 1;
+        }
+    }
+}
+
+static void stream_input_done(int epfd, struct stream *s)
+{
+    epoll_ctl(epfd, EPOLL_CTL_DEL, s->in_fd, NULL);
+    close(s->in_fd);
+
+    if(e_Buffer_Init==s->t->buffer_state) {
+        stream_finish(s); // nothing ever came in
+        return;
+    }
+    atomic_store(&s->eof, 1);
+    // start pacing what came in, if still priming
+    smooth_write_start(s->t);
+}
+
+static void report(void)
+{
+    int i;
+
+    for(i=0; i<g_stream_count; ++i) {
+        struct stream *s = &g_streams[i];
+        smooth_t *t = s->t;
+
+        if(g_verbose) {
+            smooth_write_report(t);
+            continue;
+        }
+        fprintf(stderr, "%s stream %d %s -> %s: in %ld, out %ld, level %ld, dropped %ld, underflow %ld, backpressure %ld\n",
+                MODULE, s->id, s->in_path, s->out_path,
+                t->total_in_bytes, t->total_out_bytes, smooth_write_level(t),
+                t->full_bytes[e_Full_DropOldest]+t->full_bytes[e_Full_DropNewest],
+                t->underflow_bytes, t->backpressure_bytes);
+    }
+}
+
+void signal_handler(int signo)
+{
+    fprintf(stderr, "%s signal %d received\n", MODULE, signo);
+    report();
+    exit(0);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long queue_size = RING_SIZE_DEFAULT;
+    enum smooth_full_policy full_policy = e_Full_DropNewest;
+    unsigned long target_delay_ms = CTL_TARGET_DELAY_MS_DEFAULT;
+    struct epoll_event events[64];
+    struct timespec base;
+    int epfd, inputs, i;
+
+    while(1) {
+        int c;
+
+        if( -1 == (c = getopt(argc, argv, "?hvj:q:f:d:")) ) break;
+
+        switch(c) {
+        case '?':
+        case 'h':
+            usage(argv[0]);
+            break;
+
+        case 'v':
+            g_verbose = 1;
+            break;
+
+        case 'j':
+            g_pacer_count = atoi(optarg);
+            if(g_pacer_count<1 || g_pacer_count>MAX_PACERS) {
+                fprintf(stderr, "%s pacing threads must be 1~%d\n", MODULE, MAX_PACERS);
+                exit(1);
+            }
+            break;
+
+        case 'q':
+            queue_size = strtoul(optarg, NULL, 0);
+            if(0==queue_size) {
+                fprintf(stderr, "queue size must be at least 1 byte\n");
+                exit(1);
+            }
+            break;
+
+        case 'f':
+            for(full_policy=0; full_policy<e_Full_PolicyMax; ++full_policy) {
+                if(0==strcmp(optarg, smooth_full_policy_names[full_policy])) break;
+            }
+            if(e_Full_PolicyMax==full_policy) {
+                fprintf(stderr, "unknown policy '%s'\n", optarg);
+                exit(1);
+            }
+            break;
+
+        case 'd':
+            target_delay_ms = strtoul(optarg, NULL, 0);
+            break;
+        }
+    }
+
+    if(optind>=argc) usage(argv[0]);
+
+    mono_clock_init();
+    read_config(argv[optind], target_delay_ms, queue_size, full_policy);
+    if(0==g_stream_count) {
+        fprintf(stderr, "%s no stream in '%s'\n", MODULE, argv[optind]);
+        exit(1);
+    }
+    fprintf(stderr, "%s %d streams, %d pacing threads\n", MODULE, g_stream_count, g_pacer_count);
+
+    signal(SIGINT, signal_handler);
+    // a reader going away shows up as write errors of its stream only
+    signal(SIGPIPE, SIG_IGN);
+
+    epfd = epoll_create1(0);
+    if(epfd<0) {
+        fprintf(stderr, "%s epoll_create failed: %s\n", MODULE, strerror(errno));
+        exit(1);
+    }
+    open_streams(epfd);
+
+    clock_gettime(CLOCK_MONOTONIC, &base);
+    for(i=0; i<g_pacer_count; ++i) {
+        struct pacer *p = &g_pacers[i];
+        int ret;
+
+        p->id = i;
+        p->base = base;
+        pthread_mutex_init(&p->lock, NULL);
+        wheel_init(&p->wheel);
+        ret = pthread_create(&p->thread, NULL, pacer_thread_routine, p);
+        if(ret!=0) {
+            fprintf(stderr, "%s cannot create thread: %s\n", MODULE, strerror(ret));
+            exit(1);
+        }
+    }
+
+    // input loop
+    inputs = g_stream_count;
+    while(inputs>0) {
+        int n = epoll_wait(epfd, events, sizeof(events)/sizeof(events[0]), -1);
+
+        if(n<0) {
+            if(EINTR==errno) continue;
+            fprintf(stderr, "%s epoll_wait failed: %s\n", MODULE, strerror(errno));
+            break;
+        }
+
+        for(i=0; i<n; ++i) {
+            struct stream *s = (struct stream *)events[i].data.ptr;
+
+            // a stream whose output failed stops reading too
+            if(atomic_load(&s->done) || stream_read(s)) {
+                stream_input_done(epfd, s);
+                inputs--;
+            }
+        }
+    }
+
+    // wait for pacers to write out what is left
+    while(atomic_load(&g_done_count) < g_stream_count) {
+        struct timespec ts = { 0, 100*1000*1000 };
+        nanosleep(&ts, NULL);
+    }
+
+    fprintf(stderr, "%s EOL\n", MODULE);
+    report();
+    return 0;
+}
@@ -3,9 +3,11 @@
 #include <getopt.h>
 #include <errno.h>
 #include <string.h>
-#include <sys/time.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <signal.h>
+
+#include "../trace.h"
 
 #define MODULE "[generator-clone]"
 
@@ -19,94 +21,170 @@
     #define dbg_print(fmt, args...) do {} while(0)
 #endif
 
-// Use random data samples from logs from generator and reproduce the 
-// same data write-out pattern.
+// Replay the write-out pattern of traces: generator.log, bytelog and
+// bytelog2 logs, or binary traces. Each point is written at an absolute
+// CLOCK_MONOTONIC deadline, start + trace time / scale, so oversleeping
+// or a slow write delays only that point and no drift builds up.
 //
+// Traces are played one after another, each starting where the previous
+// one ended, and the whole list may loop.
+//
+// Payload is the byte counter the other generators send, taken straight
+// from a precomputed pattern: byte n of the stream is n & 0xFF, so a
+// write of any size starts at pattern + (offset & 0xFF).
 
-struct sample {
-    unsigned long diff_ms;
-    int sleep_ms;
-    unsigned long buf_size; 
-    
-    struct sample *next;
-} *g_sample_list_head = NULL, *g_sample_list_tail = NULL;
-
-int main(int argc, char **argv)
-{
-    unsigned char *buf; //[100*1024]; 
-    unsigned long buf_size = 0;
+#define PATTERN_BYTES (1024*1024)
 
-    FILE *logf = NULL;
-    unsigned char counter = 0;
+static int g_to_quit = 0;
+static unsigned char g_pattern[PATTERN_BYTES + 256];
 
-    if(argc<2) {
-        fprintf(stderr, "usage: %s generator.log\n", argv[0]);
-        exit(1);
-    }
+static void signal_handler(int signo)
+{
+    g_to_quit = 1;
+}
 
-    logf = fopen(argv[1], "r");
-    if(NULL==logf) {
-        dbg_print("Cannot open log file\n");
-        exit(1);
+static void timespec_add_ns(struct timespec *ts, long ns)
+{
+    ts->tv_sec += ns / 1000000000L;
+    ts->tv_nsec += ns % 1000000000L;
+    if(ts->tv_nsec >= 1000000000L) {
+        ts->tv_nsec -= 1000000000L;
+        ts->tv_sec++;
     }
+}
 
-    // read generator.log and save into a list
-    do {
-        struct sample *p = malloc(sizeof(*p));
-
-        if(!p) {
-            dbg_print("malloc failed\n");
-            exit(1);
-        }
+static long timespec_diff_ns(const struct timespec *pt1, const struct timespec *pt2)
+{
+    return (pt2->tv_sec - pt1->tv_sec)*1000000000L + (pt2->tv_nsec - pt1->tv_nsec);
+}
 
-        fscanf(logf, "%ld %d %ld\n", &p->diff_ms, &p->sleep_ms, &p->buf_size);
-        p->next = NULL;
+// write nbyte bytes of pattern starting at stream offset
+static int write_pattern(unsigned long offset, unsigned long nbyte)
+{
+    while(nbyte) {
+        size_t n = nbyte<PATTERN_BYTES ? nbyte : PATTERN_BYTES;
+        ssize_t ret = write(1, g_pattern + (offset & 0xFF), n);
 
-        if(p->buf_size > buf_size) {
-            buf_size = p->buf_size;
+        if(ret<0) {
+            if(EINTR==errno && !g_to_quit) continue;
+            return -1;
         }
+        offset += ret;
+        nbyte -= ret;
+    }
+    return 0;
+}
 
-        dbg_print("%ld %d %ld\n", p->diff_ms, p->sleep_ms,
-                p->buf_size);
-
-        // first sample in list
-        if(!g_sample_list_head) {
-            g_sample_list_head = p;
-            g_sample_list_tail = p;
-        }
-        else {
-            g_sample_list_tail->next = p;
-            g_sample_list_tail = p;
+int main(int argc, char **argv)
+{
+    struct trace *traces;
+    struct timespec start, deadline, now;
+    double scale = 1;
+    int loops = 1, loop, count, i;
+    unsigned long offset = 0, points = 0, late = 0;
+    long base_ns = 0, late_max_ns = 0;
+
+    while(1) {
+        int c;
+
+        if( -1 == (c = getopt(argc, argv, "?hx:l:")) ) break;
+
+        switch(c) {
+        case '?':
+        case 'h':
+            fprintf(stderr, "usage: %s [-x scale] [-l loops] trace...\n", argv[0]);
+            fprintf(stderr, "-x play scale times faster, default 1\n");
+            fprintf(stderr, "-l play the traces this many times, 0 for forever. Default 1\n");
+            exit(1);
+            break;
+
+        case 'x':
+            scale = atof(optarg);
+            if(scale<=0) {
+                dbg_print("bad scale '%s'\n", optarg);
+                exit(1);
+            }
+            break;
+
+        case 'l':
+            loops = atoi(optarg);
+            break;
         }
+    }
 
-    } while(!feof(logf));
-    fclose(logf);
+    count = argc - optind;
+    if(count<=0) {
+        fprintf(stderr, "usage: %s [-x scale] [-l loops] trace...\n", argv[0]);
+        exit(1);
+    }
 
-    buf = malloc(buf_size);
-    if(!buf) {
-        dbg_print("cannot alloc buffer %ld bytes\n", buf_size);
+    traces = calloc(count, sizeof(struct trace));
+    if(NULL==traces) {
+        dbg_print("cannot allocate %d traces\n", count);
         exit(1);
     }
+    for(i=0; i<count; ++i) {
+        if(trace_load(&traces[i], argv[optind+i])<0) {
+            dbg_print("cannot read '%s': %s\n", argv[optind+i], strerror(errno));
+            exit(1);
+        }
+        dbg_print("%s: %lu points, %lu bytes\n", argv[optind+i], traces[i].count,
+                trace_total_bytes(&traces[i]));
+    }
 
-    // write+sleep according to the sample list
-    while(g_sample_list_head) {
-        int i=0;
-        unsigned long buf_size = 0;
-        
-        buf_size = g_sample_list_head->buf_size;
+    for(i=0; i<sizeof(g_pattern); ++i) {
+        g_pattern[i] = i;
+    }
 
-        for(i=0; i<buf_size; ++i) {
-            buf[i] = counter++;
+    signal(SIGINT, signal_handler);
+    signal(SIGPIPE, SIG_IGN);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for(loop=0; !g_to_quit && (0==loops || loop<loops); ++loop) {
+        for(i=0; !g_to_quit && i<count; ++i) {
+            const struct trace *t = &traces[i];
+            unsigned long k;
+
+            for(k=0; !g_to_quit && k<t->count; ++k) {
+                long lateness;
+
+                deadline = start;
+                timespec_add_ns(&deadline, (base_ns + t->time_ns[k]) / scale);
+                while(EINTR==clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL)
+                        && !g_to_quit);
+
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                lateness = timespec_diff_ns(&deadline, &now);
+                if(lateness > 1000000L) late++;
+                if(lateness > late_max_ns) late_max_ns = lateness;
+
+                if(write_pattern(offset, t->bytes[k])<0) {
+                    dbg_print("write failed: %s\n", strerror(errno));
+                    g_to_quit = 1;
+                    break;
+                }
+                offset += t->bytes[k];
+                points++;
+            }
+            // next trace starts where this one ended
+            if(t->count) base_ns += t->time_ns[t->count-1];
         }
+    }
 
-        write(1, buf, buf_size);
-        usleep(g_sample_list_head->sleep_ms *1000);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    {
+        double sec = timespec_diff_ns(&start, &now)/1e9;
 
-        g_sample_list_head = g_sample_list_head->next;
+        dbg_print("%lu points, %lu bytes in %.3f sec, %.0f bytes/sec\n", points, offset,
+                sec, sec>0 ? offset/sec : 0);
+        dbg_print("%lu points late by over 1 ms, most %.3f ms\n", late, late_max_ns/1e6);
     }
 
+    for(i=0; i<count; ++i) {
+        trace_free(&traces[i]);
+    }
+    free(traces);
     dbg_print("quit\n");
     exit(0);
 }
-
-
@@ -0,0 +1,393 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <time.h>
+#include <getopt.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <signal.h>
+#include <math.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "../logwriter.h"
+
+#define MODULE "[generator3]"
+
+// turn on/off debug message
+#if 1
+#define dbg_print(fmt, args...)  \
+        do {\
+            fprintf(stderr, "%s " fmt, MODULE, ##args);\
+        } while(0)
+#else
+    #define dbg_print(fmt, args...) do {} while(0)
+#endif
+
+// Synthetic traffic generator for stress tests up to multi-gigabit rates.
+//
+// Bursts are sent at absolute CLOCK_MONOTONIC deadlines, sized by a burst
+// model with a mean that gives the requested rate:
+//   constant  every burst the mean
+//   uniform   uniform in [0, 2*mean]
+//   pareto    heavy tailed, shape -a, capped at PARETO_CAP times the mean
+//             and scaled so the capped bursts still have the mean
+//   gop       video frames at -f fps following a GOP pattern such as
+//             IBBPBBPBBPBB, with I:P:B sizes in ratio 8:3:1 and +-20%
+//             jitter
+// The random generator is seeded with -S, so a run can be repeated.
+//
+// Payload is the byte counter the other generators send, byte n of the
+// stream being n & 0xFF, taken from a pattern built once. Into a pipe
+// the pattern pages are vmsplice()'d, so no byte is copied in user
+// space; anything else gets write() from the pattern.
+//
+// With -s every burst is logged through the asynchronous log writer, as
+// a binary trace when the path ends with .btr.
+
+#define PATTERN_BYTES (1024*1024)
+#define PIPE_BYTES (1024*1024)
+#define PARETO_CAP 64
+#define GOP_MAX 64
+#define GOP_JITTER 0.2
+
+enum burst_model {
+    e_Model_Constant,
+    e_Model_Uniform,
+    e_Model_Pareto,
+    e_Model_Gop,
+    e_Model_Max,
+};
+static const char *model_names[e_Model_Max] = {
+    "constant", "uniform", "pareto", "gop",
+};
+
+static int g_to_quit = 0;
+static unsigned char *g_pattern;
+static unsigned long g_rng;
+
+static void signal_handler(int signo)
+{
+    g_to_quit = 1;
+}
+
+// xorshift64*, same sequence for a seed on every platform
+static unsigned long rng_next(void)
+{
+    g_rng ^= g_rng >> 12;
+    g_rng ^= g_rng << 25;
+    g_rng ^= g_rng >> 27;
+    return g_rng * 2685821657736338717UL;
+}
+
+// uniform in (0, 1)
+static double rng_uniform(void)
+{
+    return ((rng_next() >> 11) + 0.5) / 9007199254740992.0;
+}
+
+static void timespec_add_ns(struct timespec *ts, long ns)
+{
+    ts->tv_sec += ns / 1000000000L;
+    ts->tv_nsec += ns % 1000000000L;
+    if(ts->tv_nsec >= 1000000000L) {
+        ts->tv_nsec -= 1000000000L;
+        ts->tv_sec++;
+    }
+}
+
+static long timespec_diff_ns(const struct timespec *pt1, const struct timespec *pt2)
+{
+    return (pt2->tv_sec - pt1->tv_sec)*1000000000L + (pt2->tv_nsec - pt1->tv_nsec);
+}
+
+static int is_pipe(int fd)
+{
+    struct stat st;
+    return 0==fstat(fd, &st) && S_ISFIFO(st.st_mode);
+}
+
+// number with optional K, M or G suffix, powers of 1000
+static double parse_size(const char *s)
+{
+    char *end;
+    double v = strtod(s, &end);
+
+    switch(*end) {
+    case 'k': case 'K': v *= 1e3; break;
+    case 'm': case 'M': v *= 1e6; break;
+    case 'g': case 'G': v *= 1e9; break;
+    }
+    return v;
+}
+
+// write nbyte bytes of pattern starting at stream offset
+static int send_pattern(int use_vmsplice, unsigned long offset, unsigned long nbyte)
+{
+    while(nbyte && !g_to_quit) {
+        size_t n = nbyte<PATTERN_BYTES ? nbyte : PATTERN_BYTES;
+        ssize_t ret;
+
+        if(use_vmsplice) {
+            struct iovec iov = { g_pattern + (offset & 0xFF), n };
+            ret = vmsplice(1, &iov, 1, 0);
+        }
+        else {
+            ret = write(1, g_pattern + (offset & 0xFF), n);
+        }
+        if(ret<0) {
+            if(EINTR==errno) continue;
+            return -1;
+        }
+        offset += ret;
+        nbyte -= ret;
+    }
+    return 0;
+}
+
+// scale x_m of a pareto distribution with shape alpha, capped at cap, so
+// the mean of min(X, cap) is mean:
+//   E[min(X, cap)] = (alpha*x_m - x_m^alpha * cap^(1-alpha)) / (alpha-1)
+// which grows with x_m, found by bisection between the uncapped scale
+// and mean itself
+static double pareto_scale(double mean, double alpha, double cap)
+{
+    double lo = mean*(alpha-1)/alpha, hi = mean;
+    int i;
+
+    for(i=0; i<100; ++i) {
+        double xm = (lo+hi)/2;
+        double m = (alpha*xm - pow(xm, alpha)*pow(cap, 1-alpha)) / (alpha-1);
+
+        if(m<mean) lo = xm;
+        else hi = xm;
+    }
+    return (lo+hi)/2;
+}
+
+static double gop_weight(char frame)
+{
+    switch(frame) {
+    case 'I': return 8;
+    case 'P': return 3;
+    default: return 1;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    enum burst_model model = e_Model_Constant;
+    double rate = 0, burst = 64*1024, fps = 30, alpha = 1.5, gop_mean = 0, pareto_xm = 0;
+    long interval_ns = 1000000L, run_ns = 0;
+    unsigned long max_bytes = 0, seed = time(NULL);
+    const char *gop = "IBBPBBPBBPBB";
+    const char *log_path = NULL;
+    struct log_writer logw;
+    struct timespec start, deadline, now;
+    unsigned long offset = 0, bursts = 0, late = 0;
+    long late_max_ns = 0, t_ns = 0;
+    int use_vmsplice, gop_len, i;
+
+    while(1) {
+        int c;
+
+        if( -1 == (c = getopt(argc, argv, "?hm:r:b:i:f:g:a:S:t:n:s:")) ) break;
+
+        switch(c) {
+        case '?':
+        case 'h':
+            fprintf(stderr, "usage: %s [-m model] [-r rate] [-b burst] [-i interval] [-S seed]\n", argv[0]);
+            fprintf(stderr, "       [-t seconds] [-n bytes] [-s log]\n");
+            fprintf(stderr, "-m burst model: constant, uniform, pareto or gop. Default constant\n");
+            fprintf(stderr, "-r rate in bytes/sec, K, M and G suffixes are powers of 1000.\n");
+            fprintf(stderr, "   Without it bursts of -b bytes are sent as fast as possible\n");
+            fprintf(stderr, "-b mean burst size when there is no -r, default %.0f bytes\n", burst);
+            fprintf(stderr, "-i micro seconds between bursts, default %ld\n", interval_ns/1000);
+            fprintf(stderr, "-a shape of pareto model, over 1, default %.1f\n", alpha);
+            fprintf(stderr, "-f frames per second of gop model, default %.0f\n", fps);
+            fprintf(stderr, "-g frame pattern of gop model, default %s\n", gop);
+            fprintf(stderr, "-S random seed, default the time\n");
+            fprintf(stderr, "-t stop after this many seconds\n");
+            fprintf(stderr, "-n stop after this many bytes\n");
+            fprintf(stderr, "-s log every burst, binary trace if log ends with .btr\n");
+            exit(1);
+            break;
+
+        case 'm':
+            for(i=0; i<e_Model_Max && strcmp(optarg, model_names[i]); ++i);
+            if(i==e_Model_Max) {
+                dbg_print("unknown model '%s'\n", optarg);
+                exit(1);
+            }
+            model = i;
+            break;
+
+        case 'r':
+            rate = parse_size(optarg);
+            break;
+
+        case 'b':
+            burst = parse_size(optarg);
+            break;
+
+        case 'i':
+            interval_ns = atol(optarg)*1000L;
+            break;
+
+        case 'a':
+            alpha = atof(optarg);
+            break;
+
+        case 'f':
+            fps = atof(optarg);
+            break;
+
+        case 'g':
+            gop = optarg;
+            break;
+
+        case 'S':
+            seed = strtoul(optarg, NULL, 0);
+            break;
+
+        case 't':
+            run_ns = atof(optarg)*1e9;
+            break;
+
+        case 'n':
+            max_bytes = parse_size(optarg);
+            break;
+
+        case 's':
+            log_path = optarg;
+            break;
+        }
+    }
+
+    gop_len = strlen(gop);
+    if(e_Model_Pareto==model && alpha<=1) {
+        dbg_print("pareto shape must be over 1\n");
+        exit(1);
+    }
+    if(e_Model_Gop==model) {
+        if(fps<=0 || 0==gop_len || gop_len>GOP_MAX) {
+            dbg_print("bad gop model, %.1f fps, pattern '%s'\n", fps, gop);
+            exit(1);
+        }
+        interval_ns = 1e9/fps;
+        for(i=0; i<gop_len; ++i) gop_mean += gop_weight(gop[i]);
+        gop_mean /= gop_len;
+    }
+    if(interval_ns<=0) {
+        dbg_print("interval must be positive\n");
+        exit(1);
+    }
+    if(rate>0) burst = rate*interval_ns/1e9;
+    if(e_Model_Pareto==model) pareto_xm = pareto_scale(burst, alpha, PARETO_CAP*burst);
+
+    g_pattern = aligned_alloc(4096, PATTERN_BYTES + 4096);
+    if(NULL==g_pattern) {
+        dbg_print("cannot allocate pattern\n");
+        exit(1);
+    }
+    for(i=0; i<PATTERN_BYTES + 4096; ++i) {
+        g_pattern[i] = i;
+    }
+    g_rng = seed ? seed : 1;
+
+    if(log_path) {
+        FILE *f = fopen(log_path, "w");
+        enum trace_format format = trace_format_for_path(log_path);
+
+        if(NULL==f) {
+            dbg_print("cannot open '%s' for writing: %s\n", log_path, strerror(errno));
+            exit(1);
+        }
+        if(log_writer_open(&logw, f, e_Trace_Binary==format ? format : e_Trace_TextNs,
+                    LOG_RING_RECORDS_DEFAULT)<0) {
+            exit(1);
+        }
+    }
+
+    use_vmsplice = is_pipe(1);
+    if(use_vmsplice) fcntl(1, F_SETPIPE_SZ, PIPE_BYTES);
+
+    dbg_print("%s model, mean burst %.0f bytes every %ld us, %s, seed %lu, %s\n",
+            model_names[model], burst, interval_ns/1000,
+            rate>0 ? "paced" : "unpaced", seed, use_vmsplice ? "vmsplice" : "write");
+
+    signal(SIGINT, signal_handler);
+    signal(SIGPIPE, SIG_IGN);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while(!g_to_quit) {
+        double size;
+
+        switch(model) {
+        case e_Model_Uniform:
+            size = 2*burst*rng_uniform();
+            break;
+        case e_Model_Pareto:
+            size = pareto_xm / pow(rng_uniform(), 1/alpha);
+            if(size > PARETO_CAP*burst) size = PARETO_CAP*burst;
+            break;
+        case e_Model_Gop:
+            size = burst*gop_weight(gop[bursts % gop_len])/gop_mean
+                    * (1 + GOP_JITTER*(2*rng_uniform()-1));
+            break;
+        default:
+            size = burst;
+            break;
+        }
+        if(max_bytes && offset+(unsigned long)size > max_bytes) size = max_bytes-offset;
+
+        if(rate>0) {
+            long lateness;
+
+            deadline = start;
+            timespec_add_ns(&deadline, t_ns);
+            while(EINTR==clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL)
+                    && !g_to_quit);
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            lateness = timespec_diff_ns(&deadline, &now);
+            if(lateness > 1000000L) late++;
+            if(lateness > late_max_ns) late_max_ns = lateness;
+        }
+        else {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            t_ns = timespec_diff_ns(&start, &now);
+        }
+        if(run_ns && t_ns>=run_ns) break;
+
+        if(send_pattern(use_vmsplice, offset, (unsigned long)size)<0) {
+            dbg_print("write failed: %s\n", strerror(errno));
+            break;
+        }
+        if(log_path) log_writer_push(&logw, t_ns, (unsigned long)size);
+        offset += (unsigned long)size;
+        bursts++;
+        t_ns += interval_ns;
+
+        if(max_bytes && offset>=max_bytes) break;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    {
+        double sec = timespec_diff_ns(&start, &now)/1e9;
+
+        dbg_print("%lu bursts, %lu bytes in %.3f sec, %.0f bytes/sec, %.2f Gbit/s\n",
+                bursts, offset, sec, sec>0 ? offset/sec : 0, sec>0 ? offset*8/sec/1e9 : 0);
+        if(rate>0) {
+            dbg_print("%lu bursts late by over 1 ms, most %.3f ms\n", late, late_max_ns/1e6);
+        }
+    }
+    if(log_path) {
+        log_writer_close(&logw);
+        dbg_print("log %lu records written, %lu dropped\n", logw.written, logw.dropped);
+    }
+    free(g_pattern);
+    return 0;
+}
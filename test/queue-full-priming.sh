@@ -0,0 +1,28 @@
+#!/bin/sh
+# A queue smaller than what arrives during priming fills before pacing
+# starts. With the block policy the reader must not wait forever for room;
+# every smoother has to start pacing and pass data through.
+#
+# run from test/ after building the tools: make check
+
+cd `dirname $0`
+status=0
+
+check() {
+    name=$1
+    shift
+    out=`timeout 60 sh -c "./generator3 -r 50M -t 1 2>/dev/null | $* 2>/dev/null | wc -c"`
+    ret=$?
+    if [ $ret -ne 0 ] || [ -z "$out" ] || [ "$out" -eq 0 ]; then
+        echo "FAIL $name: exit $ret, $out bytes out"
+        status=1
+    else
+        echo "ok   $name: $out bytes out"
+    fi
+}
+
+check smoother  ../smoother -m 1000000 -f block
+check smoother2 ../smoother2 -m 1000000 -f block
+check smoother3 ../smoother3 -q 1000000 -f block
+
+exit $status
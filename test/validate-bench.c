@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "../validate.h"
+
+#define MODULE "[validate-bench]"
+
+// measure every validation kernel on a counter pattern buffer, and check
+// that each one finds the same mismatch offsets as a byte by byte walk
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+int main(int argc, char **argv)
+{
+    size_t buf_size = 64*1024;
+    unsigned long total_mb = 4096;
+    unsigned char *buf;
+    int k, i;
+
+    while(1) {
+        int c;
+
+        if( -1 == (c = getopt(argc, argv, "?hb:n:")) ) break;
+
+        switch(c) {
+        case '?':
+        case 'h':
+            fprintf(stderr, "%s [-b buffer_size] [-n total_mb]\n", argv[0]);
+            fprintf(stderr, "buffer size default %ld bytes, validate %ld MB per kernel\n",
+                    buf_size, total_mb);
+            exit(1);
+            break;
+
+        case 'b':
+            buf_size = atol(optarg);
+            break;
+
+        case 'n':
+            total_mb = atol(optarg);
+            break;
+        }
+    }
+
+    buf = malloc(buf_size+1);
+    if(!buf) {
+        fprintf(stderr, "%s cannot allocate buffer of %ld bytes\n", MODULE, buf_size);
+        exit(1);
+    }
+    validate_init();
+    fprintf(stderr, "%s selected kernel: %s\n", MODULE, validate_kernel_names[validate_kernel()]);
+
+    for(k=0; k<e_Validate_KernelMax; ++k) {
+        unsigned long rounds = total_mb*1024*1024 / buf_size, r;
+        double t1, t2;
+        long errors = 0;
+
+        if(!validate_kernel_supported(k)) {
+            fprintf(stderr, "%s %-6s not supported\n", MODULE, validate_kernel_names[k]);
+            continue;
+        }
+
+        // correctness: corrupt one byte at a time at different offsets
+        for(i=0; i<buf_size && i<4096; ++i) {
+            unsigned char first = i*7;
+            size_t len = buf_size - i%61;
+            size_t pos;
+            long ret;
+
+            for(pos=0; pos<len; ++pos) buf[pos] = first+pos;
+            if(validate_block_with(k, buf, len, first)!=-1) errors++;
+            pos = (i*131) % len;
+            buf[pos] ^= 1<<(i%8);
+            ret = validate_block_with(k, buf, len, first);
+            if(ret!=(long)pos) errors++;
+        }
+
+        for(i=0; i<buf_size; ++i) buf[i] = i;
+        t1 = now_sec();
+        for(r=0; r<rounds; ++r) {
+            // start value changes so pattern loads are not always aligned
+            if(validate_block_with(k, buf+(r&1), buf_size-1, r&1)!=-1) errors++;
+        }
+        t2 = now_sec();
+
+        fprintf(stderr, "%s %-6s %.2f GB/s, %ld errors\n", MODULE, validate_kernel_names[k],
+                (double)rounds*(buf_size-1)/(t2-t1)/1e9, errors);
+    }
+
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,341 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "trace.h"
+
+const char *trace_format_names[e_Trace_FormatMax] = {
+    "ms", "ns", "gen", "bin",
+};
+
+void trace_init(struct trace *t, const char *name)
+{
+    memset(t, 0, sizeof(*t));
+    snprintf(t->name, sizeof(t->name), "%s", name);
+}
+
+void trace_free(struct trace *t)
+{
+    free(t->time_ns);
+    free(t->bytes);
+    t->time_ns = NULL;
+    t->bytes = NULL;
+    t->count = t->cap = 0;
+}
+
+int trace_reserve(struct trace *t, unsigned long cap)
+{
+    long *time_ns_new;
+    unsigned long *bytes_new;
+
+    if(cap<=t->cap) return 0;
+
+    time_ns_new = realloc(t->time_ns, cap*sizeof(long));
+    if(NULL==time_ns_new) return -1;
+    t->time_ns = time_ns_new;
+    bytes_new = realloc(t->bytes, cap*sizeof(unsigned long));
+    if(NULL==bytes_new) return -1;
+    t->bytes = bytes_new;
+    t->cap = cap;
+    return 0;
+}
+
+int trace_append(struct trace *t, long time_ns, unsigned long bytes)
+{
+    if(t->count==t->cap && trace_reserve(t, t->cap ? t->cap*2 : 4096)<0) return -1;
+
+    t->time_ns[t->count] = time_ns;
+    t->bytes[t->count] = bytes;
+    t->count++;
+    return 0;
+}
+
+// parse an unsigned decimal at p, return end of digits or NULL if none
+static inline const char *parse_ulong(const char *p, const char *end, unsigned long *v)
+{
+    const char *start = p;
+    unsigned long n = 0;
+
+    while(p<end && (unsigned)(*p-'0')<10) {
+        n = n*10 + (*p-'0');
+        ++p;
+    }
+    *v = n;
+    return p==start ? NULL : p;
+}
+
+int trace_parse(struct trace *t, const char *buf, unsigned long len)
+{
+    const char *p = buf, *end = buf+len;
+    unsigned long lines = 0, prev_ms = 0;
+    long scale = 1000000L;
+
+    // one point per line at most, size arrays once
+    for(p=buf; p<end && (p=memchr(p, '\n', end-p)); ++p) lines++;
+    if(trace_reserve(t, t->count+lines+1)<0) return -1;
+
+    // "time-in-ns bytes" logs of every read, the default is milliseconds
+    if(len>=10 && 0==memcmp(buf, "time-in-ns", 10)) scale = 1;
+
+    for(p=buf; p<end; ) {
+        const char *eol = memchr(p, '\n', end-p);
+        const char *q;
+        unsigned long v[3];
+        int n = 0;
+
+        if(NULL==eol) eol = end;
+
+        // up to three numbers, anything else is a header
+        q = p;
+        while(q<eol && (*q==' ' || *q=='\t')) ++q;
+        while(n<3 && q && q<eol && (unsigned)(*q-'0')<10) {
+            q = parse_ulong(q, eol, &v[n++]);
+            while(q<eol && (*q==' ' || *q=='\t' || *q=='\r')) ++q;
+        }
+
+        if(q==eol && 2==n) {
+            t->time_ns[t->count] = v[0]*scale;
+            t->bytes[t->count] = v[1];
+            t->count++;
+        }
+        else if(q==eol && 3==n) {
+            // generator log "diff_ms sleep_ms size", size was written
+            // when the previous line's sleep ended
+            t->time_ns[t->count] = prev_ms*1000000L;
+            t->bytes[t->count] = v[2];
+            t->count++;
+            prev_ms = v[0];
+        }
+        p = eol+1;
+    }
+    return 0;
+}
+
+static int trace_load_binary(struct trace *t, const char *path)
+{
+    struct btrace_reader r;
+    long time_ns;
+    unsigned long bytes;
+    int ret;
+
+    if(btrace_reader_open(&r, path)<0) return -1;
+    if(trace_reserve(t, r.points+1)<0) {
+        btrace_reader_close(&r);
+        errno = ENOMEM;
+        return -1;
+    }
+    while(1==(ret=btrace_reader_next(&r, &time_ns, &bytes))) {
+        if(t->count==t->cap && trace_reserve(t, t->cap*2)<0) {
+            ret = -1;
+            break;
+        }
+        t->time_ns[t->count] = time_ns;
+        t->bytes[t->count] = bytes;
+        t->count++;
+    }
+    btrace_reader_close(&r);
+    if(ret<0) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+int trace_load(struct trace *t, const char *path)
+{
+    struct stat st;
+    void *buf;
+    int fd, err = 0;
+
+    trace_init(t, path);
+
+    fd = open(path, O_RDONLY);
+    if(fd<0) return -1;
+    if(fstat(fd, &st)<0) {
+        err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    if(0==st.st_size) {
+        close(fd);
+        return 0;
+    }
+
+    buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(MAP_FAILED==buf) {
+        err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    close(fd);
+
+    if(btrace_is_btrace(buf, st.st_size)) {
+        munmap(buf, st.st_size);
+        return trace_load_binary(t, path);
+    }
+
+    madvise(buf, st.st_size, MADV_SEQUENTIAL);
+    if(trace_parse(t, buf, st.st_size)<0) err = ENOMEM;
+    munmap(buf, st.st_size);
+    if(err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+enum trace_format trace_format_for_path(const char *path)
+{
+    size_t len = strlen(path);
+
+    return len>=4 && 0==strcmp(path+len-4, ".btr") ? e_Trace_Binary : e_Trace_TextMs;
+}
+
+int trace_format_parse(const char *name)
+{
+    int i;
+
+    for(i=0; i<e_Trace_FormatMax; ++i) {
+        if(0==strcmp(name, trace_format_names[i])) return i;
+    }
+    return -1;
+}
+
+int trace_writer_open(struct trace_writer *w, FILE *f, enum trace_format format)
+{
+    memset(w, 0, sizeof(*w));
+    w->f = f;
+    w->format = format;
+
+    switch(format) {
+    case e_Trace_TextMs:
+        return fprintf(f, "time-in-ms bytes\n")<0 ? -1 : 0;
+    case e_Trace_TextNs:
+        return fprintf(f, "time-in-ns bytes\n")<0 ? -1 : 0;
+    case e_Trace_Generator:
+        return 0;
+    case e_Trace_Binary:
+        return btrace_writer_open(&w->bin, f);
+    default:
+        return -1;
+    }
+}
+
+int trace_writer_add(struct trace_writer *w, long time_ns, unsigned long bytes)
+{
+    int ret = 0;
+
+    switch(w->format) {
+    case e_Trace_TextMs:
+        ret = fprintf(w->f, "%ld %lu\n", time_ns/1000000L, bytes);
+        break;
+    case e_Trace_TextNs:
+        ret = fprintf(w->f, "%ld %lu\n", time_ns, bytes);
+        break;
+    case e_Trace_Generator:
+        // a line is written when the next point tells how long to sleep
+        if(w->pending) {
+            ret = fprintf(w->f, "%ld %ld %lu\n", time_ns/1000000L,
+                    (time_ns - w->pending_ns)/1000000L, w->pending_bytes);
+        }
+        w->pending = 1;
+        w->pending_ns = time_ns;
+        w->pending_bytes = bytes;
+        break;
+    case e_Trace_Binary:
+        ret = btrace_writer_add(&w->bin, time_ns, bytes);
+        break;
+    default:
+        ret = -1;
+        break;
+    }
+    return ret<0 ? -1 : 0;
+}
+
+int trace_writer_close(struct trace_writer *w)
+{
+    switch(w->format) {
+    case e_Trace_Generator:
+        if(w->pending && fprintf(w->f, "%ld 0 %lu\n", w->pending_ns/1000000L,
+                    w->pending_bytes)<0) return -1;
+        break;
+    case e_Trace_Binary:
+        return btrace_writer_close(&w->bin);
+    default:
+        break;
+    }
+    return fflush(w->f);
+}
+
+int trace_save(const struct trace *t, const char *path, enum trace_format format)
+{
+    struct trace_writer w;
+    unsigned long i;
+    FILE *f = fopen(path, "w");
+    int ret = 0;
+
+    if(NULL==f) return -1;
+
+    if(trace_writer_open(&w, f, format)<0) ret = -1;
+    for(i=0; 0==ret && i<t->count; ++i) {
+        if(trace_writer_add(&w, t->time_ns[i], t->bytes[i])<0) ret = -1;
+    }
+    if(0==ret && trace_writer_close(&w)<0) ret = -1;
+    if(0!=fclose(f)) ret = -1;
+    return ret;
+}
+
+struct merge_point {
+    long time_ns;
+    unsigned long bytes;
+};
+
+static int merge_point_cmp(const void *a, const void *b)
+{
+    const struct merge_point *pa = a, *pb = b;
+
+    return pa->time_ns<pb->time_ns ? -1 : pa->time_ns>pb->time_ns;
+}
+
+int trace_merge(struct trace *out, struct trace *in, int count)
+{
+    unsigned long n = 0, k = 0, i;
+    struct merge_point *p;
+    int j;
+
+    for(j=0; j<count; ++j) n += in[j].count;
+    p = malloc((n+1)*sizeof(*p));
+    if(NULL==p) return -1;
+
+    for(j=0; j<count; ++j) {
+        for(i=0; i<in[j].count; ++i, ++k) {
+            p[k].time_ns = in[j].time_ns[i];
+            p[k].bytes = in[j].bytes[i];
+        }
+    }
+    qsort(p, n, sizeof(*p), merge_point_cmp);
+
+    for(k=0; k<n; ++k) {
+        if(trace_append(out, p[k].time_ns, p[k].bytes)<0) {
+            free(p);
+            return -1;
+        }
+    }
+    free(p);
+    return 0;
+}
+
+unsigned long trace_total_bytes(const struct trace *t)
+{
+    unsigned long i, total = 0;
+
+    for(i=0; i<t->count; ++i) total += t->bytes[i];
+    return total;
+}
@@ -0,0 +1,68 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdio.h>
+
+#include "btrace.h"
+
+// ==========================================================================
+// Byte traces: a series of (time, bytes) points, as written by bytelog and
+// bytelog2 in "time-in-ms bytes" text logs, or by bytelog -e in
+// "time-in-ns bytes" logs. Bytes at a point arrived in
+// the interval ending at its time.
+//
+// Traces load from any of the formats below, told apart by their content,
+// and are written as text or as binary traces (btrace.h). Tools write
+// binary when the path ends with ".btr".
+
+enum trace_format {
+    e_Trace_TextMs,     // "time-in-ms bytes"
+    e_Trace_TextNs,     // "time-in-ns bytes"
+    e_Trace_Generator,  // test/generator.log "diff_ms sleep_ms size", from time 0
+    e_Trace_Binary,
+    e_Trace_FormatMax,
+};
+extern const char *trace_format_names[e_Trace_FormatMax];
+
+struct trace {
+    char name[256];
+    unsigned long count;
+    unsigned long cap;
+    long *time_ns; // non-decreasing
+    unsigned long *bytes;
+};
+
+void trace_init(struct trace *t, const char *name);
+void trace_free(struct trace *t);
+int trace_reserve(struct trace *t, unsigned long cap);
+int trace_append(struct trace *t, long time_ns, unsigned long bytes);
+// parse a text log in memory and append its points, lines that are not
+// "number number" or "number number number" are skipped.
+int trace_parse(struct trace *t, const char *buf, unsigned long len);
+// mmap and parse a log in any format. return -1 with errno set if the file
+// can not be read.
+int trace_load(struct trace *t, const char *path);
+int trace_save(const struct trace *t, const char *path, enum trace_format format);
+// merge several traces into one, ordered by time
+int trace_merge(struct trace *out, struct trace *in, int count);
+unsigned long trace_total_bytes(const struct trace *t);
+
+enum trace_format trace_format_for_path(const char *path);
+// format by name, or -1
+int trace_format_parse(const char *name);
+
+// streaming writer of any format on an open file, which it does not close
+struct trace_writer {
+    FILE *f;
+    enum trace_format format;
+    struct btrace_writer bin;
+    int pending; // generator log point waiting for the next one
+    long pending_ns;
+    unsigned long pending_bytes;
+};
+
+int trace_writer_open(struct trace_writer *w, FILE *f, enum trace_format format);
+int trace_writer_add(struct trace_writer *w, long time_ns, unsigned long bytes);
+int trace_writer_close(struct trace_writer *w);
+
+#endif //__TRACE_H__
@@ -0,0 +1,61 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+
+#include "trace.h"
+
+#define MODULE "[traceconv]"
+
+int main(int argc, char **argv)
+{
+    struct trace t;
+    int format = -1;
+
+    while(1) {
+        int c;
+
+        if( -1 == (c = getopt(argc, argv, "?hf:")) ) break;
+
+        switch(c) {
+        case '?':
+        case 'h':
+            fprintf(stderr, "%s [-f format] input output\n", argv[0]);
+            fprintf(stderr, "-f output format: ms, ns, gen or bin. Default is bin if output\n");
+            fprintf(stderr, "   ends with .btr, ms otherwise\n");
+            fprintf(stderr, "\nThis tool converts between \"time-in-ms bytes\" and \"time-in-ns bytes\"\n");
+            fprintf(stderr, "logs, generator.log \"diff_ms sleep_ms size\" and binary traces.\n");
+            fprintf(stderr, "The input format is detected from its content.\n\n");
+            exit(1);
+            break;
+
+        case 'f':
+            format = trace_format_parse(optarg);
+            if(format<0) {
+                fprintf(stderr, "%s unknown format '%s'\n", MODULE, optarg);
+                exit(1);
+            }
+            break;
+        }
+    }
+
+    if(argc-optind!=2) {
+        fprintf(stderr, "%s Please specify input and output.\n", MODULE);
+        exit(1);
+    }
+    if(format<0) format = trace_format_for_path(argv[optind+1]);
+
+    if(trace_load(&t, argv[optind])<0) {
+        fprintf(stderr, "%s cannot read '%s': %s\n", MODULE, argv[optind], strerror(errno));
+        exit(1);
+    }
+    if(trace_save(&t, argv[optind+1], format)<0) {
+        fprintf(stderr, "%s cannot write '%s': %s\n", MODULE, argv[optind+1], strerror(errno));
+        exit(1);
+    }
+    fprintf(stderr, "%s %lu points, %lu bytes written as %s\n", MODULE, t.count,
+            trace_total_bytes(&t), trace_format_names[format]);
+    trace_free(&t);
+    return 0;
+}
@@ -0,0 +1,171 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "validate.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define VALIDATE_HAVE_X86 1
+#endif
+
+const char *validate_kernel_names[e_Validate_KernelMax] = {
+    "scalar", "sse2", "avx2",
+};
+
+// pattern[i] == i & 0xFF, long enough to load a whole vector from any
+// starting value
+#define PATTERN_TAIL 64
+static unsigned char g_pattern[256+PATTERN_TAIL];
+
+static enum validate_kernel g_kernel = e_Validate_Scalar;
+
+// byte by byte, to locate the first mismatch of a failed block
+static long find_mismatch(const unsigned char *buf, size_t nbyte, unsigned char expect)
+{
+    size_t i;
+
+    for(i=0; i<nbyte; ++i, ++expect) {
+        if(buf[i]!=expect) return i;
+    }
+    return -1;
+}
+
+static long validate_scalar(const unsigned char *buf, size_t nbyte, unsigned char expect)
+{
+    size_t i = 0;
+
+    for(; i+8<=nbyte; i+=8, expect+=8) {
+        uint64_t a, b;
+
+        memcpy(&a, buf+i, 8);
+        memcpy(&b, g_pattern+expect, 8);
+        if(a!=b) return i + find_mismatch(buf+i, 8, expect);
+    }
+
+    long ret = find_mismatch(buf+i, nbyte-i, expect);
+    return ret<0 ? -1 : (long)i+ret;
+}
+
+#ifdef VALIDATE_HAVE_X86
+
+__attribute__((target("sse2")))
+static long validate_sse2(const unsigned char *buf, size_t nbyte, unsigned char expect)
+{
+    size_t i = 0;
+
+    // 64 bytes per round, one test for all four vectors
+    for(; i+64<=nbyte; i+=64, expect+=64) {
+        const __m128i *p = (const __m128i *)(g_pattern+expect);
+        const __m128i *b = (const __m128i *)(buf+i);
+        __m128i x0 = _mm_xor_si128(_mm_loadu_si128(b+0), _mm_loadu_si128(p+0));
+        __m128i x1 = _mm_xor_si128(_mm_loadu_si128(b+1), _mm_loadu_si128(p+1));
+        __m128i x2 = _mm_xor_si128(_mm_loadu_si128(b+2), _mm_loadu_si128(p+2));
+        __m128i x3 = _mm_xor_si128(_mm_loadu_si128(b+3), _mm_loadu_si128(p+3));
+        __m128i x = _mm_or_si128(_mm_or_si128(x0, x1), _mm_or_si128(x2, x3));
+
+        if(_mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_setzero_si128()))!=0xFFFF) {
+            return i + find_mismatch(buf+i, 64, expect);
+        }
+    }
+
+    long ret = validate_scalar(buf+i, nbyte-i, expect);
+    return ret<0 ? -1 : (long)i+ret;
+}
+
+__attribute__((target("avx2")))
+static long validate_avx2(const unsigned char *buf, size_t nbyte, unsigned char expect)
+{
+    size_t i = 0;
+
+    for(; i+64<=nbyte; i+=64, expect+=64) {
+        const __m256i *p = (const __m256i *)(g_pattern+expect);
+        const __m256i *b = (const __m256i *)(buf+i);
+        __m256i x0 = _mm256_xor_si256(_mm256_loadu_si256(b+0), _mm256_loadu_si256(p+0));
+        __m256i x1 = _mm256_xor_si256(_mm256_loadu_si256(b+1), _mm256_loadu_si256(p+1));
+
+        if(!_mm256_testz_si256(_mm256_or_si256(x0, x1), _mm256_or_si256(x0, x1))) {
+            return i + find_mismatch(buf+i, 64, expect);
+        }
+    }
+
+    long ret = validate_scalar(buf+i, nbyte-i, expect);
+    return ret<0 ? -1 : (long)i+ret;
+}
+
+#endif
+
+int validate_kernel_supported(enum validate_kernel k)
+{
+    switch(k) {
+    case e_Validate_Scalar:
+        return 1;
+#ifdef VALIDATE_HAVE_X86
+    case e_Validate_SSE2:
+        return __builtin_cpu_supports("sse2");
+    case e_Validate_AVX2:
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return 0;
+    }
+}
+
+void validate_init(void)
+{
+    int i;
+
+    for(i=0; i<sizeof(g_pattern); ++i) {
+        g_pattern[i] = i & 0xFF;
+    }
+
+#ifdef VALIDATE_HAVE_X86
+    __builtin_cpu_init();
+#endif
+    for(i=e_Validate_KernelMax-1; i>0; --i) {
+        if(validate_kernel_supported(i)) break;
+    }
+    g_kernel = i;
+}
+
+enum validate_kernel validate_kernel(void)
+{
+    return g_kernel;
+}
+
+long validate_block_with(enum validate_kernel k, const unsigned char *buf,
+                        size_t nbyte, unsigned char expect)
+{
+    switch(k) {
+#ifdef VALIDATE_HAVE_X86
+    case e_Validate_AVX2:
+        return validate_avx2(buf, nbyte, expect);
+    case e_Validate_SSE2:
+        return validate_sse2(buf, nbyte, expect);
+#endif
+    default:
+        return validate_scalar(buf, nbyte, expect);
+    }
+}
+
+long validate_block(const unsigned char *buf, size_t nbyte, unsigned char expect)
+{
+    return validate_block_with(g_kernel, buf, nbyte, expect);
+}
+
+long validate_find_sync(const unsigned char *buf, size_t nbyte, size_t from,
+                        size_t sync_bytes)
+{
+    size_t j;
+
+    if(from>=nbyte) return -1;
+    if(0==from && nbyte<sync_bytes) {
+        return validate_block(buf, nbyte, buf[0])<0 ? 0 : -1;
+    }
+
+    for(j=from; j<nbyte && j+sync_bytes<=nbyte; ++j) {
+        // most candidates fail on the next byte, skip the call
+        if(j+1<nbyte && (unsigned char)(buf[j]+1)!=buf[j+1]) continue;
+        if(validate_block(buf+j, sync_bytes, buf[j])<0) return j;
+    }
+    return -1;
+}
@@ -0,0 +1,40 @@
+#ifndef __VALIDATE_H__
+#define __VALIDATE_H__
+
+#include <stddef.h>
+
+// ==========================================================================
+// Payload validation. Generators send a rotating byte counter, so the byte
+// at stream offset n is (first + n) & 0xFF. Blocks are compared against a
+// precomputed 0..255 pattern, many bytes at a time; only a block that fails
+// is searched byte by byte for the first mismatch.
+//
+// validate_init() picks the widest kernel the CPU supports: AVX2, SSE2 or
+// a portable 64-bit scalar kernel.
+
+enum validate_kernel {
+    e_Validate_Scalar,
+    e_Validate_SSE2,
+    e_Validate_AVX2,
+    e_Validate_KernelMax,
+};
+extern const char *validate_kernel_names[e_Validate_KernelMax];
+
+void validate_init(void);
+enum validate_kernel validate_kernel(void);
+int validate_kernel_supported(enum validate_kernel k);
+
+// check nbyte of buf, buf[0] is expected to be 'expect'.
+// return offset of the first wrong byte, or -1 if all are right.
+long validate_block(const unsigned char *buf, size_t nbyte, unsigned char expect);
+long validate_block_with(enum validate_kernel k, const unsigned char *buf,
+                        size_t nbyte, unsigned char expect);
+
+// find the first offset at or after 'from' where sync_bytes bytes follow
+// the counter, starting from whatever value is there. A buffer shorter
+// than sync_bytes is in sync at 0 if all of it follows the counter.
+// return -1 if the rest of buf is not in sync anywhere.
+long validate_find_sync(const unsigned char *buf, size_t nbyte, size_t from,
+                        size_t sync_bytes);
+
+#endif //__VALIDATE_H__